@@ -13,6 +13,15 @@ for $file (<examples/*>){
 			print "Test file $file differs\n$diff";
 		}
 	}
+	# Per-core run queues: also compare the final diagram, which shows where each job ran
+	elsif( $file =~ /proc(\d+)-c(\d+)-p-(\w+)\.out/){
+		`./simulator -c $2 -s $3 -p examples/proc$1.csv | sed -n '/^FINAL TIMING DIAGRAM/,\$p' > output1`;
+		`sed -n '/^FINAL TIMING DIAGRAM/,\$p' $file > output2`;
+		$diff = `diff output1 output2`;
+		if($diff){
+			print "Test file $file differs\n$diff";
+		}
+	}
 }
 #cleanup
 `rm output1 output2`;
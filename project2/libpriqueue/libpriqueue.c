@@ -7,6 +7,232 @@
 #include "libpriqueue.h"
 
 
+/**
+  Compares two heap nodes, falling back to insertion order when the
+  comparer finds them equal so that equal elements leave the queue in the
+  order they were offered.
+
+  @return negative if a comes before b, positive otherwise
+ */
+static int node_compare(int(*comparer)(const void *, const void *), const node_t *a, const node_t *b)
+{
+  int c = comparer(a->ptr, b->ptr);
+
+  if(c != 0)
+    return c;
+
+  return a->seq < b->seq ? -1 : 1;
+}
+
+
+/**
+  Stores node at heap index i, recording the move in slots unless slots is
+  NULL, as it is for scratch copies of the heap.
+ */
+static inline void heap_set(node_t *heap, size_t *slots, size_t i, node_t node)
+{
+  heap[i] = node;
+
+  if(slots != NULL)
+    slots[node.handle] = i;
+}
+
+
+/**
+  Moves the node at index i up the heap until its parent comes before it.
+ */
+static void sift_up(int(*comparer)(const void *, const void *), node_t *heap, size_t *slots, size_t i)
+{
+  node_t node = heap[i];
+
+  while(i > 0) {
+    size_t parent = (i - 1) / 2;
+
+    if(node_compare(comparer, &node, &heap[parent]) >= 0)
+      break;
+
+    heap_set(heap, slots, i, heap[parent]);
+    i = parent;
+  }
+
+  heap_set(heap, slots, i, node);
+}
+
+
+/**
+  Moves the node at index i down a heap of n nodes until it comes before
+  both of its children.
+ */
+static void sift_down(int(*comparer)(const void *, const void *), node_t *heap, size_t *slots, size_t n, size_t i)
+{
+  node_t node = heap[i];
+
+  while(2 * i + 1 < n) {
+    size_t child = 2 * i + 1;
+
+    // Follow whichever child comes first
+    if(child + 1 < n && node_compare(comparer, &heap[child + 1], &heap[child]) < 0)
+      child++;
+
+    if(node_compare(comparer, &node, &heap[child]) <= 0)
+      break;
+
+    heap_set(heap, slots, i, heap[child]);
+    i = child;
+  }
+
+  heap_set(heap, slots, i, node);
+}
+
+
+/**
+  Moves the node at heap index i whichever way restores the heap property.
+ */
+static void heap_fix(priqueue_t *q, size_t i)
+{
+  if(i > 0 && node_compare(q->comparer, &q->heap[i], &q->heap[(i - 1) / 2]) < 0)
+    sift_up(q->comparer, q->heap, q->slots, i);
+  else
+    sift_down(q->comparer, q->heap, q->slots, q->size, i);
+}
+
+
+/**
+  Restores the heap property over the whole heap bottom-up, which is O(n)
+  rather than the O(n log n) of sifting each node up in turn.
+ */
+static void heap_build(priqueue_t *q)
+{
+  size_t i;
+
+  for(i = q->size / 2; i-- > 0; )
+    sift_down(q->comparer, q->heap, q->slots, q->size, i);
+}
+
+
+/**
+  Takes a handle off the free list, or mints a new one if it is empty.
+  There is always room for it in slots while the heap has a free node.
+ */
+static size_t handle_alloc(priqueue_t *q)
+{
+  size_t handle = q->free_handle;
+
+  if(handle != (size_t)-1)
+    q->free_handle = q->slots[handle];
+  else
+    handle = q->next_handle++;
+
+  return handle;
+}
+
+
+/**
+  Returns handle to the free list.
+ */
+static void handle_release(priqueue_t *q, size_t handle)
+{
+  q->slots[handle] = q->free_handle;
+  q->free_handle = handle;
+}
+
+
+/**
+  Removes the node at heap index i and restores the heap property.
+ */
+static void heap_remove(priqueue_t *q, size_t i)
+{
+  handle_release(q, q->heap[i].handle);
+  q->size--;
+
+  if(i == q->size)
+    return;
+
+  // Fill the hole with the last node and move it whichever way it belongs
+  heap_set(q->heap, q->slots, i, q->heap[q->size]);
+  heap_fix(q, i);
+}
+
+
+/**
+  Looks up the heap index of a handle.
+
+  @return the heap index of the handle's node
+  @return -1 if the handle does not name an element of the queue
+ */
+static long handle_find(priqueue_t *q, int handle)
+{
+  size_t i;
+
+  if(handle < 0 || (size_t)handle >= q->next_handle)
+    return -1;
+
+  // A free handle's slot holds another handle, which never points back at it
+  i = q->slots[handle];
+  if(i >= q->size || q->heap[i].handle != (size_t)handle)
+    return -1;
+
+  return i;
+}
+
+
+/**
+  Copies the heap into the queue's scratch buffer so elements can be read
+  back in priority order without disturbing q. The buffer is kept between
+  calls and only grows, so repeated walks do not allocate.
+
+  @return the copy, owned by q
+  @return NULL if out of memory
+ */
+static node_t *heap_copy(priqueue_t *q)
+{
+  size_t i;
+
+  if(q->scratch_capacity < q->size) {
+    node_t *scratch = realloc(q->scratch, q->capacity * sizeof(node_t));
+
+    if(scratch == NULL)
+      return NULL;
+
+    q->scratch = scratch;
+    q->scratch_capacity = q->capacity;
+  }
+
+  for(i = 0; i < q->size; i++)
+    q->scratch[i] = q->heap[i];
+
+  return q->scratch;
+}
+
+
+/**
+  Finds the heap index of the index'th element in priority order by popping
+  index elements off a copy of the heap.
+
+  @return the heap index of the element
+  @return -1 if out of memory
+ */
+static long heap_find(priqueue_t *q, int index)
+{
+  node_t *copy;
+  size_t n = q->size;
+
+  if(index == 0)
+    return 0;
+
+  copy = heap_copy(q);
+  if(copy == NULL)
+    return -1;
+
+  while(index-- > 0) {
+    copy[0] = copy[--n];
+    sift_down(q->comparer, copy, NULL, n, 0);
+  }
+
+  return q->slots[copy[0].handle];
+}
+
+
 /**
   Initializes the priqueue_t data structure.
   
@@ -20,73 +246,197 @@
 void priqueue_init(priqueue_t *q, int(*comparer)(const void *, const void *))
 {
   q->size = 0;
-  q->head = NULL;
+  q->heap = NULL;
+  q->capacity = 0;
+  q->slots = NULL;
+  q->free_handle = (size_t)-1;
+  q->next_handle = 0;
+  q->scratch = NULL;
+  q->scratch_capacity = 0;
+  q->seq = 0;
   q->comparer = comparer;
 }
 
 
+/**
+  Initializes the priqueue_t data structure holding the n elements of ptrs.
+
+  This is O(n), where offering the elements one at a time is O(n log n).
+  Elements the comparer finds equal leave the queue in array order.
+
+  @param q a pointer to an instance of the priqueue_t data structure
+  @param ptrs the elements to put in the queue
+  @param n the number of elements in ptrs
+  @param comparer a function pointer that compares two elements.
+  See also @ref comparer-page
+  @return 0 on success
+  @return -1 if out of memory, leaving q empty
+ */
+int priqueue_init_from_array(priqueue_t *q, void **ptrs, size_t n, int(*comparer)(const void *, const void *))
+{
+  size_t i;
+
+  priqueue_init(q, comparer);
+
+  if(priqueue_reserve(q, n) != 0)
+    return -1;
+
+  for(i = 0; i < n; i++) {
+    q->heap[i].ptr = ptrs[i];
+    q->heap[i].seq = i;
+    q->heap[i].handle = i;
+    q->slots[i] = i;
+  }
+
+  q->size = n;
+  q->seq = n;
+  q->next_handle = n;
+
+  heap_build(q);
+  return 0;
+}
+
+
+/**
+  Makes room for at least n elements, so that offering up to n elements
+  does not allocate. Storage is never given back before priqueue_destroy(),
+  so a queue that has reached its steady-state size stops allocating even
+  without calling this function.
+
+  @param q a pointer to an instance of the priqueue_t data structure
+  @param n number of elements to make room for
+  @return 0 on success
+  @return -1 if out of memory
+ */
+int priqueue_reserve(priqueue_t *q, size_t n)
+{
+  node_t *heap;
+  size_t *slots;
+
+  if(n <= q->capacity)
+    return 0;
+
+  // There is never more than one live handle per node
+  slots = realloc(q->slots, n * sizeof(size_t));
+  if(slots == NULL)
+    return -1;
+  q->slots = slots;
+
+  heap = realloc(q->heap, n * sizeof(node_t));
+  if(heap == NULL)
+    return -1;
+
+  q->heap = heap;
+  q->capacity = n;
+  return 0;
+}
+
+
 /**
   Inserts the specified element into this priority queue.
 
+  Elements the comparer finds equal keep the order in which they were
+  offered. The queue is a binary heap, so insertion is O(log n).
+
   @param q a pointer to an instance of the priqueue_t data structure
   @param ptr a pointer to the data to be inserted into the priority queue
-  @return The zero-based index where ptr is stored in the priority queue, where 0 indicates that ptr was stored at the front of the priority queue.
+  @return The zero-based index where ptr is stored in the heap, where 0 indicates that ptr was stored at the front of the priority queue. Other indices are heap positions, not ranks; priqueue_at() gives elements in rank order.
+  @return -1 if out of memory
  */
 int priqueue_offer(priqueue_t *q, void *ptr)
 {
-  // Empty queue, set q->head to a new node
-  if(q->size == 0) {
-    // Make a new node and fill it with the input pointer
-    node_t *temp = malloc(sizeof(node_t));
-    temp->ptr = ptr;
-    temp->next = NULL;
-
-    // Set the head to the new node & return
-    q->head = temp;
-    return q->size++;
+  int handle = priqueue_offer_h(q, ptr);
+
+  if(handle < 0)
+    return -1;
+
+  return q->slots[handle];
+}
+
+
+/**
+  Inserts the specified element into this priority queue and returns a
+  handle naming it.
+
+  The handle stays valid until the element leaves the queue, through
+  priqueue_poll(), any of the remove functions or priqueue_destroy(). After
+  that it may be given to a later element.
+
+  @param q a pointer to an instance of the priqueue_t data structure
+  @param ptr a pointer to the data to be inserted into the priority queue
+  @return a non-negative handle for use with priqueue_remove_h() and priqueue_update_h()
+  @return -1 if out of memory
+ */
+int priqueue_offer_h(priqueue_t *q, void *ptr)
+{
+  size_t i = q->size, handle;
+
+  // Out of room, double the heap
+  if(q->size == q->capacity
+     && priqueue_reserve(q, q->capacity ? 2 * q->capacity : 16) != 0)
+    return -1;
+
+  handle = handle_alloc(q);
+
+  q->heap[i].ptr = ptr;
+  q->heap[i].seq = q->seq++;
+  q->heap[i].handle = handle;
+  q->slots[handle] = i;
+  q->size++;
+
+  sift_up(q->comparer, q->heap, q->slots, i);
+  return handle;
+}
+
+/**
+  Moves every element of src into dst, leaving src empty.
+
+  The elements are ordered with dst's comparer. Elements that compare equal
+  keep their order within each queue, and those from src come after those
+  already in dst. Handles into src are no longer valid; the moved elements
+  get new handles in dst.
+
+  @param dst a pointer to the priqueue_t receiving the elements
+  @param src a pointer to the priqueue_t giving up its elements
+  @return 0 on success
+  @return -1 if out of memory, leaving both queues unchanged
+ */
+int priqueue_merge(priqueue_t *dst, priqueue_t *src)
+{
+  size_t n = dst->size, i;
+
+  if(src->size == 0 || dst == src)
+    return 0;
+
+  if(dst->capacity < n + src->size && priqueue_reserve(dst, n + src->size) != 0)
+    return -1;
+
+  for(i = 0; i < src->size; i++) {
+    size_t handle = handle_alloc(dst);
+
+    // Shift src's sequence numbers past dst's to keep both orders
+    dst->heap[n + i].ptr = src->heap[i].ptr;
+    dst->heap[n + i].seq = dst->seq + src->heap[i].seq;
+    dst->heap[n + i].handle = handle;
+    dst->slots[handle] = n + i;
   }
+
+  dst->size += src->size;
+  dst->seq += src->seq;
+
+  // Rebuild when src is as big as dst was, otherwise sift the newcomers up
+  if(src->size >= n)
+    heap_build(dst);
   else {
-    node_t *add = malloc(sizeof(node_t)), *temp = q->head;
-    add->ptr = ptr;
-    add->next = NULL;
-
-    int index = 0;
-    void *tempPtr;
-    q->size++;
-
-    // Cycle through the queue to find the right spot, starting at the head
-    while(temp != NULL) {
-      // If input ptr has higher priority than element we're at, shift down
-      if(q->comparer((ptr),(temp->ptr)) < 0) {
-        while(temp != NULL) {
-          // Swap values in temp and add (temp-temp, so to speak)
-          tempPtr = temp->ptr;
-          temp->ptr = add->ptr;
-          add->ptr = tempPtr;
-
-          // If at the last element, we've already swapped, so put the caboose on
-          if(temp->next == NULL) {
-            temp->next = add;
-            break;
-          }
-
-          temp = temp->next;
-        }
-        break;
-      }
-
-      // Comparison failed, move onto the next spot
-      index++;
-
-      // If at the end of the list, we've already compared, put the new value on the back
-      if(temp->next == NULL) {
-        temp->next = add;
-        break;
-      }
-      temp = temp->next;
-    }
-    return index;
+    for(i = n; i < dst->size; i++)
+      sift_up(dst->comparer, dst->heap, dst->slots, i);
   }
+
+  src->size = 0;
+  src->free_handle = (size_t)-1;
+  src->next_handle = 0;
+
+  return 0;
 }
 
 /**
@@ -101,7 +451,7 @@ void *priqueue_peek(priqueue_t *q)
 {
   // If the head exists, return it
   if(q->size != 0)
-    return q->head;
+    return q->heap[0].ptr;
   else
     return NULL;
 }
@@ -118,19 +468,9 @@ void *priqueue_peek(priqueue_t *q)
 void *priqueue_poll(priqueue_t *q)
 {
   if(q->size != 0) {
-    node_t *temp = q->head;
+    void *tempPtr = q->heap[0].ptr;
 
-    if(q->head->next != NULL)
-      q->head = q->head->next;
-    else {
-      q->head = NULL;
-    }
-
-    q->size--;
-
-    // Grab the value pointer, free this memory, and return
-    void* tempPtr = temp->ptr;
-    free(temp);
+    heap_remove(q, 0);
     return tempPtr;
   }
   else
@@ -140,6 +480,9 @@ void *priqueue_poll(priqueue_t *q)
 /**
   Returns the element at the specified position in this list, or NULL if
   the queue does not contain an index'th element.
+
+  Positions count in priority order, which a heap does not store directly,
+  so this is O(n + index log n).
  
   @param q a pointer to an instance of the priqueue_t data structure
   @param index position of retrieved element
@@ -152,16 +495,10 @@ void *priqueue_at(priqueue_t *q, int index)
   if(index < 0 || index > (int) q->size - 1)
     printf("Invalid index: priqueue_at called with index: %i\n", index);
   else {
-    node_t* temp = q->head;
-    int i = 0;
-
-    while(temp != NULL) {
-      // If we're at the right spot, return the pointer
-      if(i++ == index)
-        return temp->ptr;
+    long i = heap_find(q, index);
 
-      temp = temp->next;
-    }
+    if(i >= 0)
+      return q->heap[i].ptr;
   }
 
   return NULL;
@@ -178,36 +515,24 @@ void *priqueue_at(priqueue_t *q, int index)
  */
 int priqueue_remove(priqueue_t *q, void *ptr)
 {
-  if(q->size == 0)
-    return 0;
-  else {
-    int count = 0;
-
-    node_t *temp = q->head, *prev = q->head;
-
-    // Hold onto the previous ptr, check current, if current matches, connect previous to current->next
-    while(temp != NULL) {
-      if(temp->ptr == ptr) {
-        // Check if we're at the head
-        if(temp == q->head) {
-          q->head = prev->next;
-          prev = q->head;
-        }
-        else
-          prev->next = temp->next;
-
-        free(temp);
-
-        count++;
-      }
-      
-      temp = temp->next;
-    }
+  size_t i, kept = 0;
+  int count;
+
+  // Squeeze out every match, then rebuild the heap bottom-up
+  for(i = 0; i < q->size; i++) {
+    if(q->heap[i].ptr != ptr)
+      heap_set(q->heap, q->slots, kept++, q->heap[i]);
+    else
+      handle_release(q, q->heap[i].handle);
+  }
 
-    q->size -= count;
+  count = q->size - kept;
+  q->size = kept;
 
-    return count;
-  }
+  if(count != 0)
+    heap_build(q);
+
+  return count;
 }
 
 /**
@@ -221,60 +546,65 @@ int priqueue_remove(priqueue_t *q, void *ptr)
  */
 void *priqueue_remove_at(priqueue_t *q, int index)
 {
-  node_t *elementToRemove;
-  node_t *trailerPointer;
-  node_t *leaderPointer;
-
-  elementToRemove = q->head;
+  long i;
+  void *tempPtr;
 
   // Checks to see if queue is empty or if index doesn't exist
-  if (elementToRemove == NULL || (int)q->size - 1 < index)
-  {
+  if(index < 0 || index > (int) q->size - 1)
     return NULL;
-  }
-  else
-  {
-    if (index == 0)
-    {
-      // Fix the front of the queue
-      q->head = q->head->next;
-      q->size--;
-      void *tempPtr = elementToRemove->ptr;
-      free(elementToRemove);
-      return tempPtr;
-    }
 
-    trailerPointer = elementToRemove;
-    elementToRemove = elementToRemove->next;
+  i = heap_find(q, index);
+  if(i < 0)
+    return NULL;
 
-    if (elementToRemove->next != NULL)
-    {
-      leaderPointer = elementToRemove->next;
-    }
+  tempPtr = q->heap[i].ptr;
+  heap_remove(q, i);
+  return tempPtr;
+}
 
-    int i;
-    for (i = 1; i < index; i++)
-    {
-      if (leaderPointer->next != NULL)
-      {
-        leaderPointer = leaderPointer->next;
-      }
-      else
-      {
-        leaderPointer = NULL;
-      }
-      elementToRemove = elementToRemove->next;
-      trailerPointer = trailerPointer->next;
-    }
 
-    trailerPointer->next = leaderPointer;
-    q->size--;
-    
-    void *tempPtr = elementToRemove->ptr;
-    free(elementToRemove);
-    return tempPtr;
-  }
+/**
+  Removes the element named by a handle from priqueue_offer_h(). This is
+  O(log n).
+
+  @param q a pointer to an instance of the priqueue_t data structure
+  @param handle handle of the element to be removed
+  @return the element removed from the queue
+  @return NULL if handle does not name an element of the queue
+ */
+void *priqueue_remove_h(priqueue_t *q, int handle)
+{
+  long i = handle_find(q, handle);
+  void *tempPtr;
+
+  if(i < 0)
+    return NULL;
+
+  tempPtr = q->heap[i].ptr;
+  heap_remove(q, i);
+  return tempPtr;
+}
+
+
+/**
+  Moves the element named by a handle to its new place after its priority
+  has changed. Call this after changing whatever the comparer looks at in
+  the element. The element keeps its place among equal elements. This is
+  O(log n).
 
+  @param q a pointer to an instance of the priqueue_t data structure
+  @param handle handle of the element whose priority changed
+  @return 0 on success
+  @return -1 if handle does not name an element of the queue
+ */
+int priqueue_update_h(priqueue_t *q, int handle)
+{
+  long i = handle_find(q, handle);
+
+  if(i < 0)
+    return -1;
+
+  heap_fix(q, i);
   return 0;
 }
 
@@ -286,18 +616,18 @@ void *priqueue_remove_at(priqueue_t *q, int index)
  */
 void priqueue_destroy(priqueue_t *q)
 {
-  node_t *temp = q->head, *next;
-  q->head = NULL;
-
-  // While not at the end of the list, grab the next element and free the current one
-  while(temp != NULL) {
-    next = temp->next;
-
-    free(temp);
-
-    temp = next;
-    q->size--;
-  }
+  free(q->heap);
+  free(q->slots);
+  free(q->scratch);
+
+  q->heap = NULL;
+  q->slots = NULL;
+  q->free_handle = (size_t)-1;
+  q->next_handle = 0;
+  q->scratch = NULL;
+  q->size = 0;
+  q->capacity = 0;
+  q->scratch_capacity = 0;
 }
 
 /**
@@ -319,21 +649,20 @@ int priqueue_size(priqueue_t *q)
  */
 void priqueue_print(priqueue_t *q)
 {
-  node_t* temp = q->head;
-
-  if(temp != NULL) {
-    printf("[");
-
-    while(temp != NULL) {
-      if(temp->next != NULL) {
-        printf("%i, ", *(int *)temp->ptr);
-      }
-      else
-        printf("%i]", *(int *)temp->ptr);
-      temp = temp->next;
+  node_t *copy = heap_copy(q);
+  size_t n = q->size;
+
+  printf("[");
+
+  // Pop the copy so elements print in the order they would be polled
+  while(copy != NULL && n > 0) {
+    printf("%i", *(int *)copy[0].ptr);
+    if(--n > 0) {
+      printf(", ");
+      copy[0] = copy[n];
+      sift_down(q->comparer, copy, NULL, n, 0);
     }
   }
-  else {
-    printf("[]");
-  }
-}
\ No newline at end of file
+
+  printf("]");
+}
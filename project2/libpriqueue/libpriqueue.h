@@ -13,7 +13,11 @@ struct node_t
 {
 	void *ptr;
 
-	node_t *next;
+	// Insertion order, breaks ties between elements the comparer finds equal
+	unsigned long seq;
+
+	// Handle naming this node in the queue's slot table
+	size_t handle;
 };
 
 /**
@@ -27,19 +31,46 @@ typedef struct _priqueue_t
 	// The function to associate priority with
 	int (*comparer)(const void *, const void *);
 
-	// Pointers to the head object
-	node_t *head;
+	// Binary heap of nodes, heap[0] is the head of the queue
+	node_t *heap;
+
+	// Number of nodes heap has room for
+	size_t capacity;
+
+	// Heap index of each live handle; free handles hold the next free handle
+	size_t *slots;
+
+	// First free handle, or (size_t)-1 if every handle below next_handle is live
+	size_t free_handle;
+
+	// Handles at or above this have never been given out
+	size_t next_handle;
+
+	// Scratch copy of the heap for walking it in priority order
+	node_t *scratch;
+
+	// Number of nodes scratch has room for
+	size_t scratch_capacity;
+
+	// Sequence number given to the next offered element
+	unsigned long seq;
 } priqueue_t;
 
 
 void   priqueue_init     (priqueue_t *q, int(*comparer)(const void *, const void *));
+int    priqueue_init_from_array(priqueue_t *q, void **ptrs, size_t n, int(*comparer)(const void *, const void *));
 
+int    priqueue_reserve  (priqueue_t *q, size_t n);
 int    priqueue_offer    (priqueue_t *q, void *ptr);
+int    priqueue_offer_h  (priqueue_t *q, void *ptr);
+int    priqueue_merge    (priqueue_t *dst, priqueue_t *src);
 void * priqueue_peek     (priqueue_t *q);
 void * priqueue_poll     (priqueue_t *q);
 void * priqueue_at       (priqueue_t *q, int index);
 int    priqueue_remove   (priqueue_t *q, void *ptr);
 void * priqueue_remove_at(priqueue_t *q, int index);
+void * priqueue_remove_h (priqueue_t *q, int handle);
+int    priqueue_update_h (priqueue_t *q, int handle);
 int    priqueue_size     (priqueue_t *q);
 void   priqueue_print    (priqueue_t *q);
 
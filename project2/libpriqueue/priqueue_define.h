@@ -0,0 +1,260 @@
+/** @file priqueue_define.h
+
+  Type-specialized priority queues generated by macro.
+
+  PRIQUEUE_DEFINE(name, type, key_expr) defines name##_pq_t, a binary heap
+  of type pointers, and static inline functions operating on it. Each
+  element's key is computed once by key_expr(ptr) when it is offered and is
+  stored beside the pointer as a long long, so ordering the heap compares
+  integers in place rather than calling a comparer through a function
+  pointer and dereferencing both elements. Smaller keys leave first, and
+  equal keys leave in the order they were offered.
+
+  Because the key is captured on offer, an element whose key changes while
+  it is queued must be polled and offered again. Use libpriqueue when the
+  order can only be expressed as a comparer.
+
+    #define JOB_KEY(j) ((long long)(j)->priority)
+    PRIQUEUE_DEFINE(job, job_t, JOB_KEY)
+
+    job_pq_t q;
+    job_pq_init(&q);
+    job_pq_offer(&q, job);
+    job = job_pq_poll(&q);
+ */
+
+#ifndef PRIQUEUE_DEFINE_H_
+#define PRIQUEUE_DEFINE_H_
+
+#include <stdlib.h>
+
+#define PRIQUEUE_DEFINE(name, type, key_expr)                                  \
+                                                                               \
+typedef struct                                                                 \
+{                                                                              \
+  long long key;                                                               \
+  unsigned long seq;                                                           \
+  type *ptr;                                                                   \
+} name##_pq_node_t;                                                            \
+                                                                               \
+typedef struct                                                                 \
+{                                                                              \
+  /* Binary heap of nodes, heap[0] is the head of the queue */                 \
+  name##_pq_node_t *heap;                                                      \
+  size_t size;                                                                 \
+  size_t capacity;                                                             \
+                                                                               \
+  /* Scratch copy of the heap for walking it in priority order */              \
+  name##_pq_node_t *scratch;                                                   \
+  size_t scratch_capacity;                                                     \
+                                                                               \
+  /* Sequence number given to the next offered element */                      \
+  unsigned long seq;                                                           \
+} name##_pq_t;                                                                 \
+                                                                               \
+static inline int name##_pq_before(const name##_pq_node_t *a,                  \
+                                   const name##_pq_node_t *b)                  \
+{                                                                              \
+  return a->key < b->key || (a->key == b->key && a->seq < b->seq);             \
+}                                                                              \
+                                                                               \
+static inline void name##_pq_sift_up(name##_pq_node_t *heap, size_t i)         \
+{                                                                              \
+  name##_pq_node_t node = heap[i];                                             \
+                                                                               \
+  while(i > 0 && name##_pq_before(&node, &heap[(i - 1) / 2])) {                \
+    heap[i] = heap[(i - 1) / 2];                                               \
+    i = (i - 1) / 2;                                                           \
+  }                                                                            \
+                                                                               \
+  heap[i] = node;                                                              \
+}                                                                              \
+                                                                               \
+static inline void name##_pq_sift_down(name##_pq_node_t *heap, size_t n,       \
+                                       size_t i)                               \
+{                                                                              \
+  name##_pq_node_t node = heap[i];                                             \
+                                                                               \
+  while(2 * i + 1 < n) {                                                       \
+    size_t child = 2 * i + 1;                                                  \
+                                                                               \
+    if(child + 1 < n && name##_pq_before(&heap[child + 1], &heap[child]))      \
+      child++;                                                                 \
+                                                                               \
+    if(!name##_pq_before(&heap[child], &node))                                 \
+      break;                                                                   \
+                                                                               \
+    heap[i] = heap[child];                                                     \
+    i = child;                                                                 \
+  }                                                                            \
+                                                                               \
+  heap[i] = node;                                                              \
+}                                                                              \
+                                                                               \
+static inline void name##_pq_init(name##_pq_t *q)                              \
+{                                                                              \
+  q->heap = NULL;                                                              \
+  q->size = 0;                                                                 \
+  q->capacity = 0;                                                             \
+  q->scratch = NULL;                                                           \
+  q->scratch_capacity = 0;                                                     \
+  q->seq = 0;                                                                  \
+}                                                                              \
+                                                                               \
+/* Makes room for n elements, returning -1 if out of memory */                 \
+static inline int name##_pq_reserve(name##_pq_t *q, size_t n)                  \
+{                                                                              \
+  name##_pq_node_t *heap;                                                      \
+                                                                               \
+  if(n <= q->capacity)                                                         \
+    return 0;                                                                  \
+                                                                               \
+  heap = realloc(q->heap, n * sizeof(name##_pq_node_t));                       \
+  if(heap == NULL)                                                             \
+    return -1;                                                                 \
+                                                                               \
+  q->heap = heap;                                                              \
+  q->capacity = n;                                                             \
+  return 0;                                                                    \
+}                                                                              \
+                                                                               \
+/* Inserts ptr in O(log n), returning -1 if out of memory */                   \
+static inline int name##_pq_offer(name##_pq_t *q, type *ptr)                   \
+{                                                                              \
+  name##_pq_node_t node;                                                       \
+  size_t i = q->size;                                                          \
+                                                                               \
+  if(q->size == q->capacity                                                    \
+     && name##_pq_reserve(q, q->capacity ? 2 * q->capacity : 16) != 0)         \
+    return -1;                                                                 \
+                                                                               \
+  node.key = (long long)(key_expr(ptr));                                       \
+  node.seq = q->seq++;                                                         \
+  node.ptr = ptr;                                                              \
+                                                                               \
+  q->heap[i] = node;                                                           \
+  name##_pq_sift_up(q->heap, i);                                               \
+  q->size++;                                                                   \
+  return 0;                                                                    \
+}                                                                              \
+                                                                               \
+/* Moves every element of src into dst, leaving src empty. Keys are kept, */   \
+/* and elements with equal keys come after those already in dst, in their */   \
+/* order in src. Returns -1 if out of memory, leaving both unchanged */        \
+static inline int name##_pq_merge(name##_pq_t *dst, name##_pq_t *src)          \
+{                                                                              \
+  size_t n = dst->size, i;                                                     \
+                                                                               \
+  if(src->size == 0 || dst == src)                                             \
+    return 0;                                                                  \
+                                                                               \
+  /* An empty dst takes src's heap whole; its sequence numbers stay below */   \
+  /* every number dst gives out from now on */                                 \
+  if(n == 0) {                                                                 \
+    name##_pq_node_t *heap = dst->heap;                                        \
+    size_t capacity = dst->capacity;                                           \
+                                                                               \
+    dst->heap = src->heap;                                                     \
+    dst->capacity = src->capacity;                                             \
+    dst->size = src->size;                                                     \
+    dst->seq += src->seq;                                                      \
+    src->heap = heap;                                                          \
+    src->capacity = capacity;                                                  \
+    src->size = 0;                                                             \
+    return 0;                                                                  \
+  }                                                                            \
+                                                                               \
+  if(name##_pq_reserve(dst, n + src->size) != 0)                               \
+    return -1;                                                                 \
+                                                                               \
+  /* Shift src's sequence numbers past dst's to keep both orders */            \
+  for(i = 0; i < src->size; i++) {                                             \
+    dst->heap[n + i] = src->heap[i];                                           \
+    dst->heap[n + i].seq += dst->seq;                                          \
+  }                                                                            \
+                                                                               \
+  dst->size += src->size;                                                      \
+  dst->seq += src->seq;                                                        \
+                                                                               \
+  /* Rebuild when src is as big as dst was, otherwise sift the newcomers up */ \
+  if(src->size >= n) {                                                         \
+    for(i = dst->size / 2; i-- > 0; )                                          \
+      name##_pq_sift_down(dst->heap, dst->size, i);                            \
+  }                                                                            \
+  else {                                                                       \
+    for(i = n; i < dst->size; i++)                                             \
+      name##_pq_sift_up(dst->heap, i);                                         \
+  }                                                                            \
+                                                                               \
+  src->size = 0;                                                               \
+  return 0;                                                                    \
+}                                                                              \
+                                                                               \
+/* Returns the head of the queue, or NULL if it is empty */                    \
+static inline type *name##_pq_peek(name##_pq_t *q)                             \
+{                                                                              \
+  return q->size != 0 ? q->heap[0].ptr : NULL;                                 \
+}                                                                              \
+                                                                               \
+/* Removes and returns the head of the queue, or NULL if it is empty */        \
+static inline type *name##_pq_poll(name##_pq_t *q)                             \
+{                                                                              \
+  type *ptr;                                                                   \
+                                                                               \
+  if(q->size == 0)                                                             \
+    return NULL;                                                               \
+                                                                               \
+  ptr = q->heap[0].ptr;                                                        \
+  if(--q->size != 0) {                                                         \
+    q->heap[0] = q->heap[q->size];                                             \
+    name##_pq_sift_down(q->heap, q->size, 0);                                  \
+  }                                                                            \
+                                                                               \
+  return ptr;                                                                  \
+}                                                                              \
+                                                                               \
+static inline int name##_pq_size(name##_pq_t *q)                               \
+{                                                                              \
+  return q->size;                                                              \
+}                                                                              \
+                                                                               \
+/* Calls fn on every element in the order they would be polled, returning */   \
+/* -1 without calling it if out of memory */                                   \
+static inline int name##_pq_walk(name##_pq_t *q,                               \
+                                 void (*fn)(type *, void *), void *arg)        \
+{                                                                              \
+  size_t n = q->size, i;                                                       \
+                                                                               \
+  if(q->scratch_capacity < n) {                                                \
+    name##_pq_node_t *scratch =                                                \
+      realloc(q->scratch, q->capacity * sizeof(name##_pq_node_t));             \
+                                                                               \
+    if(scratch == NULL)                                                        \
+      return -1;                                                               \
+                                                                               \
+    q->scratch = scratch;                                                      \
+    q->scratch_capacity = q->capacity;                                         \
+  }                                                                            \
+                                                                               \
+  for(i = 0; i < n; i++)                                                       \
+    q->scratch[i] = q->heap[i];                                                \
+                                                                               \
+  while(n > 0) {                                                               \
+    fn(q->scratch[0].ptr, arg);                                                \
+    if(--n > 0) {                                                              \
+      q->scratch[0] = q->scratch[n];                                           \
+      name##_pq_sift_down(q->scratch, n, 0);                                   \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  return 0;                                                                    \
+}                                                                              \
+                                                                               \
+static inline void name##_pq_destroy(name##_pq_t *q)                           \
+{                                                                              \
+  free(q->heap);                                                               \
+  free(q->scratch);                                                            \
+  name##_pq_init(q);                                                           \
+}
+
+#endif /* PRIQUEUE_DEFINE_H_ */
@@ -1,36 +1,451 @@
 /** @file libscheduler.c
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "libscheduler.h"
-#include "../libpriqueue/libpriqueue.h"
+#include "../libpriqueue/priqueue_define.h"
+
+int m_cores;
+job_t **m_coreArr;
+scheme_t m_type;
+
+int m_numJobs;
+float m_waitingTime;
+float m_turnaroundTime;
+float m_responseTime;
+
+/**
+ * Queue key of a job under the current scheme, smaller runs first. Jobs
+ * with equal keys run in the order they were queued, so FCFS and RR give
+ * every job the same key.
+ */
+static inline long long job_key(job_t *job)
+{
+  switch (m_type)
+  {
+    case SJF:
+    case PSJF:
+      return job->processTime;
+
+    case PRI:
+    case PPRI:
+      // Priority first, then arrival time
+      return (long long)job->priority * 4294967296LL + (unsigned int)job->arrivalTime;
+
+    default:
+      return 0;
+  }
+}
+
+PRIQUEUE_DEFINE(job, job_t, job_key)
+
+/**
+ * Run queues, one per core when m_perCore is set, otherwise a single
+ * queue shared by every core
+ */
+job_pq_t *m_queues;
+int m_numQueues;
+int m_perCore = 0;
 
 /**
- * Global priqueue
+ * Bitmask of idle cores, one bit per core
  */
-priqueue_t q;
+unsigned long *m_idleMask;
 
-int FCFScompare(const void * a, const void * b)
+/**
+ * Load balancing statistics
+ */
+int m_migrations;
+long m_imbalanceSum;
+int m_imbalanceSamples;
+int m_imbalanceMax;
+
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+/**
+ * CFS tunables, in simulator time units. Every runnable job should get a
+ * turn within CFS_LATENCY, but no slice is shorter than
+ * CFS_MIN_GRANULARITY. A waking job preempts only if it is more than
+ * CFS_WAKEUP_GRANULARITY of weighted run time behind.
+ */
+#define CFS_LATENCY 12
+#define CFS_MIN_GRANULARITY 2
+#define CFS_WAKEUP_GRANULARITY 1
+
+/**
+ * vruntime is kept in 1/1024ths of a time unit at the weight of nice 0
+ */
+#define CFS_NICE_0_WEIGHT 1024
+#define CFS_VRUNTIME_SHIFT 10
+
+/**
+ * Load weight of each nice level from -20 to 19, as in the Linux kernel;
+ * each level is worth about 10% of CPU time against its neighbour
+ */
+static const int cfs_nice_to_weight[40] = {
+  88761, 71755, 56483, 46273, 36291,
+  29154, 23254, 18705, 14949, 11916,
+  9548, 7620, 6100, 4904, 3906,
+  3121, 2501, 1991, 1586, 1277,
+  1024, 820, 655, 526, 423,
+  335, 272, 215, 172, 137,
+  110, 87, 70, 56, 45,
+  36, 29, 23, 18, 15,
+};
+
+/**
+ * MLFQ levels. A job starts at level 0 and drops a level each time it uses
+ * up its quantum, which doubles at every level down.
+ */
+#define MLFQ_LEVELS 4
+
+/**
+ * MLFQ settings: quantum at level 0, how often every job is boosted back
+ * to level 0, and how long a job may wait before it is promoted one level
+ */
+int m_mlfqQuantum = 2;
+int m_mlfqBoostPeriod = 50;
+int m_mlfqAgingLimit = 20;
+int m_mlfqLastBoost;
+
+/**
+ * CFS run queue ordered by vruntime, total weight of runnable jobs and the
+ * floor new jobs start their vruntime from
+ */
+rb_root_t m_cfsTree;
+long m_cfsLoad;
+long long m_cfsMinVruntime;
+
+
+/**
+  Orders CFS jobs by vruntime.
+ */
+static int cfs_less(const rb_node_t *a, const rb_node_t *b)
+{
+  return rb_entry(a, job_t, node)->vruntime < rb_entry(b, job_t, node)->vruntime;
+}
+
+
+/**
+  Charges a running job for the time since it was last charged, scaled by
+  its weight so heavier jobs accrue vruntime more slowly.
+ */
+static void cfs_update(job_t *job, int time)
 {
-  return 1;
+  long long delta = time - job->lastCheckedTime;
+
+  job->vruntime += (delta << CFS_VRUNTIME_SHIFT) * CFS_NICE_0_WEIGHT / job->weight;
+  job->lastCheckedTime = time;
+}
+
+
+/**
+  Advances the vruntime floor to the smallest vruntime among running and
+  queued jobs. It never moves backwards.
+ */
+static void cfs_update_min()
+{
+  long long min = LLONG_MAX;
+  int i;
+
+  for (i = 0; i < m_cores; i++)
+  {
+    if (m_coreArr[i] != NULL && m_coreArr[i]->vruntime < min)
+      min = m_coreArr[i]->vruntime;
+  }
+
+  if (rb_first(&m_cfsTree) != NULL && rb_entry(rb_first(&m_cfsTree), job_t, node)->vruntime < min)
+    min = rb_entry(rb_first(&m_cfsTree), job_t, node)->vruntime;
+
+  if (min != LLONG_MAX && min > m_cfsMinVruntime)
+    m_cfsMinVruntime = min;
 }
 
-int SJFcompare(const void * a, const void * b)
+
+/**
+  Returns the run queue a core takes its jobs from.
+ */
+static inline job_pq_t *scheduler_queue(int core_id)
 {
-  return ((*(job_t*)a).processTime - (*(job_t*)b).processTime);
+  return &m_queues[m_perCore ? core_id : 0];
 }
 
-int PRIcompare(const void * a, const void * b)
+
+/**
+  Moves every job waiting below level 0 up to level 0 once per boost
+  period, and otherwise promotes jobs that have waited longer than the
+  aging limit by one level. Levels are FIFO, so only their heads need to be
+  checked for aging.
+
+  A queued job takes its level from the queue it is polled from, so a boost
+  only merges queues and never visits the jobs in them.
+ */
+static void mlfq_maintain(int time)
 {
-  int compare = (*(job_t *)a).priority - (*(job_t *)b).priority;
+  int level, i;
+  job_t *job;
 
-  if(compare == 0)
-    return (*(job_t *)a).arrivalTime - (*(job_t *)b).arrivalTime;
+  if (m_mlfqBoostPeriod > 0 && time - m_mlfqLastBoost >= m_mlfqBoostPeriod)
+  {
+    m_mlfqLastBoost = time;
+
+    // Every level is FIFO, so each one joins the back of level 0 whole
+    for (level = 1; level < MLFQ_LEVELS; level++)
+      job_pq_merge(&m_queues[0], &m_queues[level]);
+
+    for (i = 0; i < m_cores; i++)
+    {
+      if (m_coreArr[i] != NULL)
+        m_coreArr[i]->level = 0;
+    }
+  }
+
+  if (m_mlfqAgingLimit <= 0)
+    return;
+
+  for (level = 1; level < MLFQ_LEVELS; level++)
+  {
+    while ((job = job_pq_peek(&m_queues[level])) != NULL
+        && time - job->queuedTime >= m_mlfqAgingLimit)
+    {
+      job_pq_poll(&m_queues[level]);
+      job->level = level - 1;
+      job->queuedTime = time;
+      job_pq_offer(&m_queues[level - 1], job);
+    }
+  }
+}
+
+
+/**
+  Puts a job on a core, or marks the core idle if job is NULL.
+ */
+static void scheduler_set_core(int core_id, job_t *job)
+{
+  unsigned long bit = 1UL << (core_id % BITS_PER_LONG);
+
+  m_coreArr[core_id] = job;
+
+  if (job == NULL)
+    m_idleMask[core_id / BITS_PER_LONG] |= bit;
   else
-    return compare;
+    m_idleMask[core_id / BITS_PER_LONG] &= ~bit;
+}
+
+
+/**
+  Finds the run queue holding the most jobs, preferring the lowest core id
+  on ties.
+
+  @return core id owning the longest queue
+ */
+static int scheduler_busiest_queue()
+{
+  int i, busiest = 0;
+
+  for (i = 1; i < m_cores; i++)
+  {
+    if (job_pq_size(&m_queues[i]) > job_pq_size(&m_queues[busiest]))
+      busiest = i;
+  }
+
+  return busiest;
+}
+
+
+/**
+  Finds the run queue holding the fewest jobs, preferring the lowest core
+  id on ties.
+
+  @return core id owning the shortest queue
+ */
+static int scheduler_idlest_queue()
+{
+  int i, idlest = 0;
+
+  for (i = 1; i < m_cores; i++)
+  {
+    if (job_pq_size(&m_queues[i]) < job_pq_size(&m_queues[idlest]))
+      idlest = i;
+  }
+
+  return idlest;
+}
+
+
+/**
+  Records how far apart the longest and shortest run queues are.
+ */
+static void scheduler_sample_imbalance()
+{
+  int imbalance;
+
+  if (!m_perCore)
+    return;
+
+  imbalance = job_pq_size(&m_queues[scheduler_busiest_queue()])
+            - job_pq_size(&m_queues[scheduler_idlest_queue()]);
+
+  m_imbalanceSum += imbalance;
+  m_imbalanceSamples++;
+
+  if (imbalance > m_imbalanceMax)
+    m_imbalanceMax = imbalance;
+}
+
+
+/**
+  Queues a job that is not going to run right away. With per-core run
+  queues, a job that has run goes back to its last core's queue and a new
+  job goes to the shortest queue. Under MLFQ a job joins the back of its
+  level.
+ */
+static void scheduler_enqueue(job_t *job, int time)
+{
+  int core_id = 0;
+
+  if (m_type == CFS)
+  {
+    rb_insert(&m_cfsTree, &job->node, cfs_less);
+    return;
+  }
+
+  if (m_type == MLFQ)
+  {
+    job->queuedTime = time;
+    job_pq_offer(&m_queues[job->level], job);
+    return;
+  }
+
+  if (m_perCore)
+    core_id = job->lastCore != -1 ? job->lastCore : scheduler_idlest_queue();
+
+  job_pq_offer(&m_queues[core_id], job);
+}
+
+
+/**
+  Pulls jobs from the busiest run queue to the given core's queue until
+  they are within one job of each other. An empty queue steals the head of
+  any queue that still has work.
+ */
+static void scheduler_balance(int core_id)
+{
+  job_pq_t *rq = &m_queues[core_id];
+  int busiest = scheduler_busiest_queue();
+  job_pq_t *from = &m_queues[busiest];
+
+  if (busiest == core_id)
+    return;
+
+  while (job_pq_size(from) - job_pq_size(rq) > 1
+      || (job_pq_size(rq) == 0 && job_pq_size(from) > 0))
+  {
+    job_pq_offer(rq, job_pq_poll(from));
+  }
+}
+
+
+/**
+  Takes the next job for a core off its run queue, balancing first if
+  run queues are per core, and prepares it to run.
+
+  @return the job to run on core_id
+  @return NULL if there is no work anywhere
+ */
+static job_t *scheduler_next_job(int core_id, int time)
+{
+  job_t *job;
+
+  if (m_perCore)
+    scheduler_balance(core_id);
+
+  if (m_type == CFS)
+  {
+    job = rb_first(&m_cfsTree) ? rb_entry(rb_first(&m_cfsTree), job_t, node) : NULL;
+    if (job != NULL)
+      rb_erase(&m_cfsTree, &job->node);
+  }
+  else if (m_type == MLFQ)
+  {
+    int level;
+
+    // Highest non-empty level first
+    mlfq_maintain(time);
+
+    job = NULL;
+    for (level = 0; level < MLFQ_LEVELS && job == NULL; level++)
+      job = job_pq_poll(&m_queues[level]);
+
+    if (job != NULL)
+      job->level = level - 1;
+  }
+  else
+    job = job_pq_poll(scheduler_queue(core_id));
+
+  if (job == NULL)
+    return NULL;
+
+  if (m_type == PSJF || m_type == CFS)
+  {
+    job->lastCheckedTime = time;
+  }
+
+  if (job->responseTime == -1)
+  {
+    job->responseTime = time - job->arrivalTime;
+  }
+
+  // Count jobs that resume somewhere other than where they last ran
+  if (job->lastCore != -1 && job->lastCore != core_id)
+  {
+    m_migrations++;
+  }
+  job->lastCore = core_id;
+
+  return job;
+}
+
+
+/**
+  Selects per-core run queues instead of one global run queue. Each core
+  takes work from its own queue, new jobs go to the shortest queue, and a
+  core that runs out of work pulls jobs from the busiest queue.
+
+  Assumptions:
+    - This function must be called before scheduler_start_up().
+    - Per-core run queues only apply to FCFS, SJF, PSJF, PRI, PPRI and RR.
+      CFS and MLFQ keep their own run queues, which are always global, and
+      scheduler_start_up() ignores this setting for them.
+
+  @param enable non-zero for per-core run queues, zero for a global queue
+ */
+void scheduler_use_per_core_queues(int enable)
+{
+  m_perCore = enable;
+}
+
+
+/**
+  Sets up the MLFQ scheme. Jobs at level n get a quantum of
+  quantum * 2^n.
+
+  Assumptions:
+    - This function must be called before scheduler_start_up().
+
+  @param quantum the quantum of the top level
+  @param boost_period how often every job is moved back to the top level, or 0 never to boost
+  @param aging_limit how long a job may wait before moving up one level, or 0 never to age
+ */
+void scheduler_configure_mlfq(int quantum, int boost_period, int aging_limit)
+{
+  m_mlfqQuantum = quantum;
+  m_mlfqBoostPeriod = boost_period;
+  m_mlfqAgingLimit = aging_limit;
 }
 
 
@@ -44,38 +459,48 @@ int PRIcompare(const void * a, const void * b)
     - You may assume that scheme is a valid scheduling scheme.
 
   @param cores the number of cores that is available by the scheduler. These cores will be known as core(id=0), core(id=1), ..., core(id=cores-1).
-  @param scheme  the scheduling scheme that should be used. This value will be one of the six enum values of scheme_t
+  @param scheme  the scheduling scheme that should be used. This value will be one of the eight enum values of scheme_t: FCFS, SJF, PSJF, PRI, PPRI, RR, CFS or MLFQ
 */
 void scheduler_start_up(int cores, scheme_t scheme)
 {
   m_cores = cores;
-  m_coreArr = malloc(cores * sizeof(job_t));
+  m_coreArr = malloc(cores * sizeof(job_t *));
+  m_idleMask = calloc((cores + BITS_PER_LONG - 1) / BITS_PER_LONG, sizeof(unsigned long));
 
   m_waitingTime = 0.0;
   m_responseTime = 0.0;
   m_turnaroundTime = 0.0;
   m_numJobs = 0;
 
+  m_migrations = 0;
+  m_imbalanceSum = 0;
+  m_imbalanceSamples = 0;
+  m_imbalanceMax = 0;
+
   // Initializes core array so that all cores are in unused state at startup
   int i;
   for (i = 0; i < cores; i++)
   {
-    m_coreArr[i] = NULL;
+    scheduler_set_core(i, NULL);
   }
 
   m_type = scheme;
 
-  if (m_type == FCFS || m_type == RR)
-  {
-    priqueue_init(&q, FCFScompare);
-  }
-  else if (m_type == SJF || m_type == PSJF)
-  {
-    priqueue_init(&q, SJFcompare);
-  }
-  else if (m_type == PRI || m_type == PPRI)
+  // CFS and MLFQ index their own run queues, so per-core queues would not fit
+  if (m_type == CFS || m_type == MLFQ)
+    m_perCore = 0;
+
+  m_mlfqLastBoost = 0;
+
+  rb_init(&m_cfsTree);
+  m_cfsLoad = 0;
+  m_cfsMinVruntime = 0;
+
+  m_numQueues = m_perCore ? cores : m_type == MLFQ ? MLFQ_LEVELS : 1;
+  m_queues = malloc(m_numQueues * sizeof(job_pq_t));
+  for (i = 0; i < m_numQueues; i++)
   {
-    priqueue_init(&q, PRIcompare);
+    job_pq_init(&m_queues[i]);
   }
 }
 
@@ -89,11 +514,11 @@ void scheduler_start_up(int cores, scheme_t scheme)
 int scheduler_idle_core_finder()
 {
   int i;
-  for (i = 0; i < m_cores; i++)
+  for (i = 0; i * (int)BITS_PER_LONG < m_cores; i++)
   {
-    if (m_coreArr[i] == NULL)
+    if (m_idleMask[i] != 0)
     {
-      return i;
+      return i * BITS_PER_LONG + __builtin_ctzl(m_idleMask[i]);
     }
   }
 
@@ -131,18 +556,41 @@ int scheduler_new_job(int job_number, int time, int running_time, int priority)
   temp->priority = priority;
   temp->originalProcessTime = running_time;
   temp->processTime = running_time;
+  temp->lastCheckedTime = time;
   temp->responseTime = -1;
+  temp->lastCore = -1;
+  temp->level = 0;
+
+  if (m_type == CFS)
+  {
+    int i;
+
+    // Bring running jobs up to date so the new job starts level with the
+    // least served of them
+    for (i = 0; i < m_cores; i++)
+    {
+      if (m_coreArr[i] != NULL)
+        cfs_update(m_coreArr[i], time);
+    }
+    cfs_update_min();
+
+    temp->weight = cfs_nice_to_weight[priority < -20 ? 0 : priority > 19 ? 39 : priority + 20];
+    temp->vruntime = m_cfsMinVruntime;
+    m_cfsLoad += temp->weight;
+  }
 
   if (firstIdleCoreFound != -1)
   {
     // Signal that the core at firstIdleCoreFound is being used
-    m_coreArr[firstIdleCoreFound] = temp;
+    scheduler_set_core(firstIdleCoreFound, temp);
     m_coreArr[firstIdleCoreFound]->responseTime = time - m_coreArr[firstIdleCoreFound]->arrivalTime;
+    temp->lastCore = firstIdleCoreFound;
 
-    if (m_type == PSJF)
+    if (m_type == PSJF || m_type == CFS)
     {
       temp->lastCheckedTime = time;
     }
+    scheduler_sample_imbalance();
     return firstIdleCoreFound;
   }
   else if (m_type == PSJF)
@@ -176,13 +624,15 @@ int scheduler_new_job(int job_number, int time, int running_time, int priority)
         m_coreArr[indexOfJobWithLongestRuntime]->responseTime = -1;
       }
 
-      priqueue_offer(&q, m_coreArr[indexOfJobWithLongestRuntime]);
-      m_coreArr[indexOfJobWithLongestRuntime] = temp;
+      scheduler_enqueue(m_coreArr[indexOfJobWithLongestRuntime], time);
+      scheduler_set_core(indexOfJobWithLongestRuntime, temp);
+      temp->lastCore = indexOfJobWithLongestRuntime;
 
       if(m_coreArr[indexOfJobWithLongestRuntime]->responseTime == -1)
       {
         m_coreArr[indexOfJobWithLongestRuntime]->responseTime = time - m_coreArr[indexOfJobWithLongestRuntime]->arrivalTime;
       }
+      scheduler_sample_imbalance();
       return indexOfJobWithLongestRuntime;
     }
   }
@@ -216,21 +666,86 @@ int scheduler_new_job(int job_number, int time, int running_time, int priority)
       }
 
       // Send the job running on the found core to the priqueue, put temp in its place
-      priqueue_offer(&q, m_coreArr[lowestPriCore]);
-      m_coreArr[lowestPriCore] = temp;
+      scheduler_enqueue(m_coreArr[lowestPriCore], time);
+      scheduler_set_core(lowestPriCore, temp);
+      temp->lastCore = lowestPriCore;
 
       if(m_coreArr[lowestPriCore]->responseTime == -1)
       {
         m_coreArr[lowestPriCore]->responseTime = time - m_coreArr[lowestPriCore]->arrivalTime;
       }
 
+      scheduler_sample_imbalance();
       return lowestPriCore;
     }
     // Else, put temp on the queue and signal no scheduling changes
   }
+  else if (m_type == MLFQ)
+  {
+    // New jobs enter the top level, so they preempt the running job from
+    // the lowest level below it
+    int i, lowestLevelCore = 0;
+
+    mlfq_maintain(time);
+
+    for (i = 1; i < m_cores; i++)
+    {
+      if (m_coreArr[i]->level > m_coreArr[lowestLevelCore]->level)
+        lowestLevelCore = i;
+    }
+
+    if (m_coreArr[lowestLevelCore]->level > 0)
+    {
+      // If we just scheduled this job and it's getting pre-empted, reset the response time
+      if(m_coreArr[lowestLevelCore]->responseTime == time - m_coreArr[lowestLevelCore]->arrivalTime)
+      {
+        m_coreArr[lowestLevelCore]->responseTime = -1;
+      }
+
+      scheduler_enqueue(m_coreArr[lowestLevelCore], time);
+      scheduler_set_core(lowestLevelCore, temp);
+      temp->lastCore = lowestLevelCore;
+      temp->responseTime = time - temp->arrivalTime;
+
+      scheduler_sample_imbalance();
+      return lowestLevelCore;
+    }
+  }
+  else if (m_type == CFS)
+  {
+    // Preempt the running job furthest ahead in vruntime if the new job is
+    // more than the wakeup granularity behind it
+    int i, mostServedCore = 0;
+    long long granularity = ((long long)CFS_WAKEUP_GRANULARITY << CFS_VRUNTIME_SHIFT) * CFS_NICE_0_WEIGHT / temp->weight;
+
+    for (i = 1; i < m_cores; i++)
+    {
+      if (m_coreArr[i]->vruntime > m_coreArr[mostServedCore]->vruntime)
+        mostServedCore = i;
+    }
+
+    if (m_coreArr[mostServedCore]->vruntime - temp->vruntime > granularity)
+    {
+      // If we just scheduled this job and it's getting pre-empted, reset the response time
+      if(m_coreArr[mostServedCore]->responseTime == time - m_coreArr[mostServedCore]->arrivalTime)
+      {
+        m_coreArr[mostServedCore]->responseTime = -1;
+      }
+
+      scheduler_enqueue(m_coreArr[mostServedCore], time);
+      scheduler_set_core(mostServedCore, temp);
+      temp->lastCore = mostServedCore;
+      temp->lastCheckedTime = time;
+      temp->responseTime = time - temp->arrivalTime;
+
+      scheduler_sample_imbalance();
+      return mostServedCore;
+    }
+  }
 
   // If at this step, no scheduling changes should be made
-  priqueue_offer(&q, temp);
+  scheduler_enqueue(temp, time);
+  scheduler_sample_imbalance();
   return -1;
 }
 
@@ -258,25 +773,18 @@ int scheduler_job_finished(int core_id, int job_number, int time)
   m_numJobs++;
 
   // Free up the core where the finished job has completed
+  if (m_type == CFS)
+  {
+    m_cfsLoad -= m_coreArr[core_id]->weight;
+  }
   free(m_coreArr[core_id]);
-  m_coreArr[core_id] = NULL;
+  scheduler_set_core(core_id, NULL);
 
-  if (priqueue_size(&q) != 0)
-  {
-    job_t* temp = (job_t*)priqueue_poll(&q);
-    if (m_type == PSJF)
-    {
-      temp->lastCheckedTime = time;
-    }
-    m_coreArr[core_id] = temp;
-    if(m_coreArr[core_id]->responseTime == -1)
-    {
-      m_coreArr[core_id]->responseTime = time - m_coreArr[core_id]->arrivalTime;
-    }
+  job_t* temp = scheduler_next_job(core_id, time);
+  scheduler_set_core(core_id, temp);
+  scheduler_sample_imbalance();
 
-    return temp->pid;
-  }
-  return -1;
+  return temp != NULL ? temp->pid : -1;
 }
 
 
@@ -297,25 +805,62 @@ int scheduler_quantum_expired(int core_id, int time)
 {
   job_t* jobCurrentlyOnSpecifiedCore = m_coreArr[core_id];
 
-  if (jobCurrentlyOnSpecifiedCore == NULL)
+  // Under CFS the job goes back in by vruntime, so it keeps running unless
+  // another job has now had less weighted time
+  if (m_type == CFS && jobCurrentlyOnSpecifiedCore != NULL)
   {
-    if (priqueue_size(&q) == 0)
-    {
-      // Core remains idle
-      return -1;
-    }
+    cfs_update(jobCurrentlyOnSpecifiedCore, time);
+    cfs_update_min();
   }
-  else
+
+  // Under MLFQ a job that uses up its quantum drops a level
+  if (m_type == MLFQ && jobCurrentlyOnSpecifiedCore != NULL
+      && jobCurrentlyOnSpecifiedCore->level < MLFQ_LEVELS - 1)
   {
-    priqueue_offer(&q, jobCurrentlyOnSpecifiedCore);
+    jobCurrentlyOnSpecifiedCore->level++;
   }
 
-  m_coreArr[core_id] = priqueue_poll(&q);
-  if(m_coreArr[core_id]->responseTime == -1)
+  // Send the running job to the back of its queue and take the next one
+  if (jobCurrentlyOnSpecifiedCore != NULL)
   {
-    m_coreArr[core_id]->responseTime = time - m_coreArr[core_id]->arrivalTime;
+    scheduler_enqueue(jobCurrentlyOnSpecifiedCore, time);
   }
-  return m_coreArr[core_id]->pid;
+
+  job_t* temp = scheduler_next_job(core_id, time);
+  scheduler_set_core(core_id, temp);
+  scheduler_sample_imbalance();
+
+  // Core remains idle if there was nothing to run
+  return temp != NULL ? temp->pid : -1;
+}
+
+
+/**
+  Returns how long the job now running on a core may run before
+  scheduler_quantum_expired() should be called for that core. Under CFS
+  this is the job's share of CFS_LATENCY by weight, but at least
+  CFS_MIN_GRANULARITY. Under MLFQ it is the quantum of the job's level.
+
+  @param core_id the zero-based index of the core
+  @return the length of the core's next time slice
+  @return -1 if the scheme does not choose its own time slices
+ */
+int scheduler_quantum(int core_id)
+{
+  job_t *job = m_coreArr[core_id];
+  long slice;
+
+  if (m_type == MLFQ)
+    return m_mlfqQuantum << (job != NULL ? job->level : 0);
+
+  if (m_type != CFS)
+    return -1;
+
+  if (job == NULL)
+    return CFS_MIN_GRANULARITY;
+
+  slice = CFS_LATENCY * job->weight / m_cfsLoad;
+  return slice > CFS_MIN_GRANULARITY ? slice : CFS_MIN_GRANULARITY;
 }
 
 
@@ -358,6 +903,42 @@ float scheduler_average_response_time()
 }
 
 
+/**
+  Returns the number of times a job started running on a different core
+  from the one it last ran on.
+
+  @return the number of migrations
+ */
+int scheduler_migrations()
+{
+  return m_migrations;
+}
+
+
+/**
+  Returns the average difference in length between the longest and
+  shortest run queues, sampled after every scheduler event.
+
+  @return the average queue imbalance, 0 with a global run queue
+ */
+float scheduler_average_imbalance()
+{
+  return m_imbalanceSamples ? (float)m_imbalanceSum / m_imbalanceSamples : 0.0;
+}
+
+
+/**
+  Returns the largest difference in length seen between the longest and
+  shortest run queues.
+
+  @return the largest queue imbalance, 0 with a global run queue
+ */
+int scheduler_max_imbalance()
+{
+  return m_imbalanceMax;
+}
+
+
 /**
   Free any memory associated with your scheduler.
  
@@ -375,6 +956,28 @@ void scheduler_clean_up()
     }
   }
   free(m_coreArr);
+  free(m_idleMask);
+
+  for (i = 0; i < m_numQueues; i++)
+  {
+    job_pq_destroy(&m_queues[i]);
+  }
+  free(m_queues);
+}
+
+
+/**
+  Prints one job of the queue for scheduler_show_queue()
+
+  @param job the job to print
+  @param arg pointer to a flag that is set until the first job is printed
+ */
+static void scheduler_print_job(job_t *job, void *arg)
+{
+  int *first = arg;
+
+  printf(*first ? "%i" : ", %i", job->pid);
+  *first = 0;
 }
 
 
@@ -391,5 +994,35 @@ void scheduler_clean_up()
  */
 void scheduler_show_queue()
 {
-  priqueue_print(&q);
+  int i, first;
+  size_t j;
+
+  if (m_type == CFS)
+  {
+    rb_node_t *node;
+
+    first = 1;
+    printf("[");
+    for (node = rb_first(&m_cfsTree); node != NULL; node = rb_next(node))
+      scheduler_print_job(rb_entry(node, job_t, node), &first);
+    printf("]");
+    return;
+  }
+
+  // Per-core run queues are listed as core:[jobs], MLFQ levels as level:[jobs]
+  for (i = 0; i < m_numQueues; i++)
+  {
+    if (m_numQueues > 1)
+      printf(i == 0 ? "%d:" : " %d:", i);
+
+    first = 1;
+    printf("[");
+
+    // Without memory to sort a copy, list the jobs in heap order instead
+    if (job_pq_walk(&m_queues[i], scheduler_print_job, &first) != 0)
+      for (j = 0; j < m_queues[i].size; j++)
+        scheduler_print_job(m_queues[i].heap[j].ptr, &first);
+
+    printf("]");
+  }
 }
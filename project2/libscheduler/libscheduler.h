@@ -4,10 +4,12 @@
 #ifndef LIBSCHEDULER_H_
 #define LIBSCHEDULER_H_
 
+#include "rbtree.h"
+
 /**
   Constants which represent the different scheduling algorithms
 */
-typedef enum {FCFS = 0, SJF, PSJF, PRI, PPRI, RR} scheme_t;
+typedef enum {FCFS = 0, SJF, PSJF, PRI, PPRI, RR, CFS, MLFQ} scheme_t;
 
 /**
   Stores information making up a job to be scheduled including any statistics.
@@ -23,24 +25,40 @@ typedef struct _job_t
   int processTime;
   int responseTime;
   int lastCheckedTime;
+  int lastCore;
+
+  // MLFQ: current level and when the job last joined a queue
+  int level;
+  int queuedTime;
+
+  // CFS: weighted run time, load weight and run queue link
+  long long vruntime;
+  int weight;
+  rb_node_t node;
 } job_t;
 
-int m_cores;
-job_t **m_coreArr;
-scheme_t m_type;
+extern int m_cores;
+extern job_t **m_coreArr;
+extern scheme_t m_type;
 
-int m_numJobs;
-float m_waitingTime;
-float m_turnaroundTime;
-float m_responseTime;
+extern int m_numJobs;
+extern float m_waitingTime;
+extern float m_turnaroundTime;
+extern float m_responseTime;
 
+void  scheduler_use_per_core_queues    (int enable);
+void  scheduler_configure_mlfq         (int quantum, int boost_period, int aging_limit);
 void  scheduler_start_up               (int cores, scheme_t scheme);
 int   scheduler_new_job                (int job_number, int time, int running_time, int priority);
 int   scheduler_job_finished           (int core_id, int job_number, int time);
 int   scheduler_quantum_expired        (int core_id, int time);
+int   scheduler_quantum                (int core_id);
 float scheduler_average_turnaround_time();
 float scheduler_average_waiting_time   ();
 float scheduler_average_response_time  ();
+int   scheduler_migrations             ();
+float scheduler_average_imbalance      ();
+int   scheduler_max_imbalance          ();
 void  scheduler_clean_up               ();
 
 void  scheduler_show_queue             ();
@@ -0,0 +1,340 @@
+/** @file rbtree.c
+
+  Intrusive red-black tree in the style of the Linux rbtree: nodes are
+  embedded in the structures they order, so inserting and erasing never
+  allocate. Nodes that compare equal are kept in insertion order.
+ */
+
+#include <stdlib.h>
+
+#include "rbtree.h"
+
+
+/**
+  Rotates the subtree rooted at x to the left, making its right child the
+  new subtree root.
+ */
+static void rb_rotate_left(rb_root_t *tree, rb_node_t *x)
+{
+  rb_node_t *y = x->right;
+
+  x->right = y->left;
+  if (y->left != NULL)
+    y->left->parent = x;
+
+  y->parent = x->parent;
+  if (x->parent == NULL)
+    tree->root = y;
+  else if (x == x->parent->left)
+    x->parent->left = y;
+  else
+    x->parent->right = y;
+
+  y->left = x;
+  x->parent = y;
+}
+
+
+/**
+  Rotates the subtree rooted at x to the right, making its left child the
+  new subtree root.
+ */
+static void rb_rotate_right(rb_root_t *tree, rb_node_t *x)
+{
+  rb_node_t *y = x->left;
+
+  x->left = y->right;
+  if (y->right != NULL)
+    y->right->parent = x;
+
+  y->parent = x->parent;
+  if (x->parent == NULL)
+    tree->root = y;
+  else if (x == x->parent->right)
+    x->parent->right = y;
+  else
+    x->parent->left = y;
+
+  y->right = x;
+  x->parent = y;
+}
+
+
+/**
+  Puts v in the place of u under u's parent.
+ */
+static void rb_transplant(rb_root_t *tree, rb_node_t *u, rb_node_t *v)
+{
+  if (u->parent == NULL)
+    tree->root = v;
+  else if (u == u->parent->left)
+    u->parent->left = v;
+  else
+    u->parent->right = v;
+
+  if (v != NULL)
+    v->parent = u->parent;
+}
+
+
+/**
+  Initializes an empty tree.
+
+  @param tree the tree to initialize
+ */
+void rb_init(rb_root_t *tree)
+{
+  tree->root = NULL;
+  tree->first = NULL;
+}
+
+
+/**
+  Inserts a node into a tree in O(log n). A node equal to nodes already in
+  the tree goes after them.
+
+  @param tree the tree to insert into
+  @param node the node to insert, which must not be in any tree
+  @param less returns non-zero if its first node orders before its second
+ */
+void rb_insert(rb_root_t *tree, rb_node_t *node, int (*less)(const rb_node_t *, const rb_node_t *))
+{
+  rb_node_t **link = &tree->root, *parent = NULL, *grandparent, *uncle;
+  int leftmost = 1;
+
+  while (*link != NULL)
+  {
+    parent = *link;
+
+    if (less(node, parent))
+      link = &parent->left;
+    else
+    {
+      link = &parent->right;
+      leftmost = 0;
+    }
+  }
+
+  node->parent = parent;
+  node->left = NULL;
+  node->right = NULL;
+  node->red = 1;
+  *link = node;
+
+  if (leftmost)
+    tree->first = node;
+
+  // Repair red nodes with red parents, working up towards the root
+  while ((parent = node->parent) != NULL && parent->red)
+  {
+    grandparent = parent->parent;
+
+    if (parent == grandparent->left)
+    {
+      uncle = grandparent->right;
+
+      if (uncle != NULL && uncle->red)
+      {
+        parent->red = 0;
+        uncle->red = 0;
+        grandparent->red = 1;
+        node = grandparent;
+        continue;
+      }
+
+      if (node == parent->right)
+      {
+        rb_rotate_left(tree, parent);
+        node = parent;
+        parent = node->parent;
+      }
+
+      parent->red = 0;
+      grandparent->red = 1;
+      rb_rotate_right(tree, grandparent);
+    }
+    else
+    {
+      uncle = grandparent->left;
+
+      if (uncle != NULL && uncle->red)
+      {
+        parent->red = 0;
+        uncle->red = 0;
+        grandparent->red = 1;
+        node = grandparent;
+        continue;
+      }
+
+      if (node == parent->left)
+      {
+        rb_rotate_right(tree, parent);
+        node = parent;
+        parent = node->parent;
+      }
+
+      parent->red = 0;
+      grandparent->red = 1;
+      rb_rotate_left(tree, grandparent);
+    }
+  }
+
+  tree->root->red = 0;
+}
+
+
+/**
+  Removes a node from a tree in O(log n).
+
+  @param tree the tree holding node
+  @param node the node to remove
+ */
+void rb_erase(rb_root_t *tree, rb_node_t *node)
+{
+  rb_node_t *y = node, *x, *xparent, *w;
+  int removed_red = node->red;
+
+  if (tree->first == node)
+    tree->first = rb_next(node);
+
+  if (node->left == NULL)
+  {
+    x = node->right;
+    xparent = node->parent;
+    rb_transplant(tree, node, node->right);
+  }
+  else if (node->right == NULL)
+  {
+    x = node->left;
+    xparent = node->parent;
+    rb_transplant(tree, node, node->left);
+  }
+  else
+  {
+    // Two children, so the successor takes node's place and color
+    y = node->right;
+    while (y->left != NULL)
+      y = y->left;
+
+    removed_red = y->red;
+    x = y->right;
+
+    if (y->parent == node)
+      xparent = y;
+    else
+    {
+      xparent = y->parent;
+      rb_transplant(tree, y, y->right);
+      y->right = node->right;
+      y->right->parent = y;
+    }
+
+    rb_transplant(tree, node, y);
+    y->left = node->left;
+    y->left->parent = y;
+    y->red = node->red;
+  }
+
+  if (removed_red)
+    return;
+
+  // A black node left, so x carries an extra black until it can shed it
+  while (x != tree->root && (x == NULL || !x->red))
+  {
+    if (x == xparent->left)
+    {
+      w = xparent->right;
+
+      if (w->red)
+      {
+        w->red = 0;
+        xparent->red = 1;
+        rb_rotate_left(tree, xparent);
+        w = xparent->right;
+      }
+
+      if ((w->left == NULL || !w->left->red) && (w->right == NULL || !w->right->red))
+      {
+        w->red = 1;
+        x = xparent;
+        xparent = x->parent;
+        continue;
+      }
+
+      if (w->right == NULL || !w->right->red)
+      {
+        w->left->red = 0;
+        w->red = 1;
+        rb_rotate_right(tree, w);
+        w = xparent->right;
+      }
+
+      w->red = xparent->red;
+      xparent->red = 0;
+      w->right->red = 0;
+      rb_rotate_left(tree, xparent);
+      x = tree->root;
+    }
+    else
+    {
+      w = xparent->left;
+
+      if (w->red)
+      {
+        w->red = 0;
+        xparent->red = 1;
+        rb_rotate_right(tree, xparent);
+        w = xparent->left;
+      }
+
+      if ((w->left == NULL || !w->left->red) && (w->right == NULL || !w->right->red))
+      {
+        w->red = 1;
+        x = xparent;
+        xparent = x->parent;
+        continue;
+      }
+
+      if (w->left == NULL || !w->left->red)
+      {
+        w->right->red = 0;
+        w->red = 1;
+        rb_rotate_left(tree, w);
+        w = xparent->left;
+      }
+
+      w->red = xparent->red;
+      xparent->red = 0;
+      w->left->red = 0;
+      rb_rotate_right(tree, xparent);
+      x = tree->root;
+    }
+  }
+
+  if (x != NULL)
+    x->red = 0;
+}
+
+
+/**
+  Returns the node after a given one in tree order.
+
+  @param node a node in a tree
+  @return the next node
+  @return NULL if node is the last node
+ */
+rb_node_t *rb_next(rb_node_t *node)
+{
+  if (node->right != NULL)
+  {
+    node = node->right;
+    while (node->left != NULL)
+      node = node->left;
+    return node;
+  }
+
+  while (node->parent != NULL && node == node->parent->right)
+    node = node->parent;
+
+  return node->parent;
+}
@@ -0,0 +1,52 @@
+/** @file rbtree.h
+ */
+
+#ifndef RBTREE_H_
+#define RBTREE_H_
+
+#include <stddef.h>
+
+/**
+  Red-black tree node, embedded in the structure it links into a tree
+*/
+typedef struct rb_node_t rb_node_t;
+
+struct rb_node_t
+{
+  rb_node_t *parent;
+  rb_node_t *left;
+  rb_node_t *right;
+  int red;
+};
+
+/**
+  Red-black tree, with its smallest node cached
+*/
+typedef struct _rb_root_t
+{
+  rb_node_t *root;
+
+  // Leftmost node, or NULL if the tree is empty
+  rb_node_t *first;
+} rb_root_t;
+
+/**
+  Gets the structure an embedded node belongs to
+*/
+#define rb_entry(ptr, type, member) \
+  ((type *)((char *)(ptr) - offsetof(type, member)))
+
+void        rb_init  (rb_root_t *tree);
+void        rb_insert(rb_root_t *tree, rb_node_t *node, int (*less)(const rb_node_t *, const rb_node_t *));
+void        rb_erase (rb_root_t *tree, rb_node_t *node);
+rb_node_t * rb_next  (rb_node_t *node);
+
+/**
+  Returns the smallest node of a tree in O(1), or NULL if it is empty
+*/
+static inline rb_node_t *rb_first(rb_root_t *tree)
+{
+  return tree->first;
+}
+
+#endif /* RBTREE_H_ */
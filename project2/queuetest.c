@@ -5,6 +5,11 @@
 #include <stdlib.h>
 
 #include "libpriqueue/libpriqueue.h"
+#include "libpriqueue/priqueue_define.h"
+
+/* Typed queue of ints ordered by value divided by ten, so that ties show */
+#define INT_KEY(p) (*(p) / 10)
+PRIQUEUE_DEFINE(int, int, INT_KEY)
 
 int compare1(const void * a, const void * b)
 {
@@ -30,6 +35,9 @@ int main()
 	for (i = 0; i < 100; i++)
 		values[i] = i;
 
+	printf("Reserve: %d (expected 0).\n", priqueue_reserve(&q, 100));
+	printf("Total elements: %d (expected 0).\n", priqueue_size(&q));
+
 	/* Add 5 values, 3 unique. */
 	priqueue_offer(&q, &values[12]);
 	priqueue_offer(&q, &values[13]);
@@ -52,14 +60,14 @@ int main()
 	printf("Total elements: %d (expected 1).\n", priqueue_size(&q));
 	priqueue_print(&q);
 
-	priqueue_offer(&q, &values[10]);
-	priqueue_offer(&q, &values[30]);
-	priqueue_offer(&q, &values[20]);
+	printf("Offered at: %d", priqueue_offer(&q, &values[10]));
+	printf(" %d", priqueue_offer(&q, &values[30]));
+	printf(" %d (expected 0 2 3).\n", priqueue_offer(&q, &values[20]));
 	printf("Total elements: %d (expected 4).\n", priqueue_size(&q));
 
-	priqueue_offer(&q2, &values[10]);
-	priqueue_offer(&q2, &values[30]);
-	priqueue_offer(&q2, &values[20]);
+	printf("Offered at: %d", priqueue_offer(&q2, &values[10]));
+	printf(" %d", priqueue_offer(&q2, &values[30]));
+	printf(" %d (expected 0 0 2).\n", priqueue_offer(&q2, &values[20]));
 	printf("Total elements: %d (expected 3).\n", priqueue_size(&q2));
 
 	printf("Elements in order queue (expected 10 13 20 30): ");
@@ -73,6 +81,60 @@ int main()
 		printf("%d ", *((int *)priqueue_at(&q2, i)) );
 	printf("\n");
 
+	/* Reprioritize and remove through handles. */
+	int h40 = priqueue_offer_h(&q2, &values[40]);
+	int h50 = priqueue_offer_h(&q2, &values[50]);
+	values[40] = 5;
+	priqueue_update_h(&q2, h40);
+	printf("Removed by handle: %d (expected 50).\n", *((int *)priqueue_remove_h(&q2, h50)));
+	printf("Stale handle: %p (expected (nil)).\n", priqueue_remove_h(&q2, h50));
+	printf("Elements in reverse order queue (expected 30 20 10 5): ");
+	for (i = 0; i < priqueue_size(&q2); i++)
+		printf("%d ", *((int *)priqueue_at(&q2, i)) );
+	printf("\n");
+
+	/* Build a queue in one pass and merge it into another. */
+	priqueue_t q3;
+	void *ptrs[] = { &values[7], &values[3], &values[9], &values[1] };
+	priqueue_init_from_array(&q3, ptrs, 4, compare1);
+	printf("Top element: %d (expected 1).\n", *((int *)priqueue_peek(&q3)));
+
+	priqueue_merge(&q3, &q);
+	printf("Total elements: %d %d (expected 8 0).\n", priqueue_size(&q3), priqueue_size(&q));
+	priqueue_print(&q3);
+	printf("\n");
+	priqueue_destroy(&q3);
+
+	/* Merge typed queues; equal keys keep dst's elements first. */
+	int_pq_t t1, t2;
+	int_pq_init(&t1);
+	int_pq_init(&t2);
+	int_pq_offer(&t1, &values[21]);
+	int_pq_offer(&t1, &values[5]);
+	int_pq_offer(&t2, &values[22]);
+	int_pq_offer(&t2, &values[3]);
+	int_pq_offer(&t2, &values[20]);
+	int_pq_merge(&t1, &t2);
+	printf("Total elements: %d %d (expected 5 0).\n", int_pq_size(&t1), int_pq_size(&t2));
+	printf("Elements in merged typed queue (expected 5 3 21 22 20): ");
+	while (int_pq_size(&t1) > 0)
+		printf("%d ", *int_pq_poll(&t1));
+	printf("\n");
+	/* Merge into an empty queue; later offers still come after equal keys. */
+	int_pq_offer(&t2, &values[33]);
+	int_pq_offer(&t2, &values[31]);
+	int_pq_merge(&t1, &t2);
+	int_pq_offer(&t1, &values[30]);
+	int_pq_offer(&t2, &values[1]);
+	printf("Total elements: %d %d (expected 3 1).\n", int_pq_size(&t1), int_pq_size(&t2));
+	printf("Elements in merged typed queue (expected 33 31 30): ");
+	while (int_pq_size(&t1) > 0)
+		printf("%d ", *int_pq_poll(&t1));
+	printf("\n");
+
+	int_pq_destroy(&t1);
+	int_pq_destroy(&t2);
+
 	priqueue_destroy(&q2);
 	priqueue_destroy(&q);
 	printf("Total elements q: %d (expected 0).\n", priqueue_size(&q));
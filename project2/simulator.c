@@ -3,55 +3,130 @@
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "libscheduler/libscheduler.h"
 
+// Bytes of event log held in memory between writes
+#define EVENT_LOG_BUFFER_SIZE (1 << 20)
+
 
 typedef struct _simulator_job_list_t
 {
 	int job_id, arrival_time, run_time, priority;
 	int core_id, arrived;
+
+	// Position in the active job list, or -1 once the job has finished
+	int slot;
 } simulator_job_list_t;
 
+// A stretch of the timing diagram in which a core ran one job, or was idle (-1)
+typedef struct _timing_span_t
+{
+	int job_id, units;
+} timing_span_t;
+
 void print_usage(char *program_name)
 {
-	fprintf(stderr, "Usage: %s -c <cores> -s <scheme> <input file>\n", program_name);
+	fprintf(stderr, "Usage: %s -c <cores> -s <scheme> [-p] [-b <boost>] [-a <aging>] [-q] [-l <log file>] <input file>\n", program_name);
 	fprintf(stderr, "       %s -c 2 -s fcfs examples/proc1.csv\n", program_name);
 	fprintf(stderr, "\n");
-	fprintf(stderr, "Acceptable schemes are: fcfs, sjf, psjf, pri, ppri, rr#\n");
+	fprintf(stderr, "Acceptable schemes are: fcfs, sjf, psjf, pri, ppri, rr#, cfs, mlfq#\n");
+	fprintf(stderr, "  -p  Give each core its own run queue, with load balancing and work stealing (not with cfs or mlfq)\n");
+	fprintf(stderr, "  -b  MLFQ: boost every job to the top level this often (default: 50, 0 for never)\n");
+	fprintf(stderr, "  -a  MLFQ: promote a job that has waited this long (default: 20, 0 for never)\n");
+	fprintf(stderr, "  -q  Quiet: print only the final statistics\n");
+	fprintf(stderr, "  -l  Write every arrival, start, preemption, quantum expiry and finish to a CSV event log\n");
 }
 
-int set_active_job(int job_id, int core_id, simulator_job_list_t *jobs, int active_jobs)
+int set_active_job(int job_id, int core_id, simulator_job_list_t *jobs, int job_count, int *core_job)
 {
-	int i;
-	for (i = 0; i < active_jobs; i++)
-	{
-		if (jobs[i].job_id == job_id && jobs[i].arrived)
-		{
-			jobs[i].core_id = core_id;
-			return 1;
-		}
-	}
+	if (job_id < 0 || job_id >= job_count || !jobs[job_id].arrived || jobs[job_id].slot == -1)
+		return 0;
 
-	return 0;
+	// A job taken from another core leaves that core idle
+	if (jobs[job_id].core_id != -1)
+		core_job[jobs[job_id].core_id] = -1;
+
+	jobs[job_id].core_id = core_id;
+	core_job[core_id] = job_id;
+	return 1;
+}
+
+/*
+ * Writes an event to the event log, if there is one, as a CSV row.
+ */
+void log_event(FILE *event_log, int time, const char *event, int job_id, int core_id)
+{
+	if (event_log != NULL)
+		fprintf(event_log, "%d,%s,%d,%d\n", time, event, job_id, core_id);
+}
+
+/*
+ * Orders jobs by arrival time, then by job id.
+ */
+int compare_arrivals(const void *a, const void *b)
+{
+	const simulator_job_list_t *job_a = *(simulator_job_list_t * const *)a;
+	const simulator_job_list_t *job_b = *(simulator_job_list_t * const *)b;
+
+	if (job_a->arrival_time != job_b->arrival_time)
+		return job_a->arrival_time < job_b->arrival_time ? -1 : 1;
+
+	return job_a->job_id - job_b->job_id;
+}
+
+/*
+ * Length of the next time slice on a core: the scheduler's choice if it
+ * makes one, otherwise the fixed RR quantum.
+ */
+int next_quantum(int quantum, int core_id)
+{
+	int slice = scheduler_quantum(core_id);
+
+	return slice > 0 ? slice : quantum;
+}
+
+/*
+ * Prints a job's symbol in the timing diagram once for each time unit: its id
+ * as a digit or letter, "(id)" for larger ids, or '-' for an idle core.
+ */
+void print_span(int job_id, int units)
+{
+	char label[16];
+
+	if (job_id == -1)
+		strcpy(label, "-");
+	else if (job_id < 10)
+		sprintf(label, "%d", job_id);
+	else if (job_id < 10 + 26)
+		sprintf(label, "%c", job_id - 10 + 'a');
+	else if (job_id < 10 + 26 + 26)
+		sprintf(label, "%c", job_id - 10 - 26 + 'A');
+	else
+		snprintf(label, sizeof(label), "(%d)", job_id);
+
+	size_t length = strlen(label);
+	while (units-- > 0)
+		fwrite(label, 1, length, stdout);
 }
 
-void print_available_jobs(simulator_job_list_t *jobs, int active_jobs)
+void print_available_jobs(simulator_job_list_t *jobs, int *order, int active_jobs)
 {
 	printf("Active jobs are: ");
 
 	int i, first = 1;
 	for (i = 0; i < active_jobs; i++)
 	{
-		if (jobs[i].arrived)
+		if (jobs[order[i]].arrived)
 		{
 			if (first)
 			{
-				printf("%d", jobs[i].job_id);
+				printf("%d", order[i]);
 				first = 0;
 			}
 			else
-				printf(", %d", jobs[i].job_id);
+				printf(", %d", order[i]);
 		}
 	}
 
@@ -77,13 +152,14 @@ void print_available_cores(int cores)
 int main(int argc, char **argv)
 {
 	int c;
-	int cores = 0, scheme = -1, quantum = 0;
-	char *file_name;
+	int cores = 0, scheme = -1, quantum = 0, per_core = 0;
+	int boost_period = 50, aging_limit = 20, quiet = 0;
+	char *file_name, *log_file_name = NULL;
 
 	/*
 	 * Parse command line options.
 	 */
-	while ((c = getopt(argc, argv, "c:s:")) != -1)
+	while ((c = getopt(argc, argv, "c:s:pb:a:ql:")) != -1)
 	{
 		switch (c)
 		{
@@ -104,6 +180,19 @@ int main(int argc, char **argv)
 				else if (strcasecmp(optarg, "PSJF") == 0) { scheme = PSJF; }
 				else if (strcasecmp(optarg, "PRI") == 0) { scheme = PRI; }
 				else if (strcasecmp(optarg, "PPRI") == 0) { scheme = PPRI; }
+				else if (strcasecmp(optarg, "CFS") == 0) { scheme = CFS; }
+				else if (strncasecmp(optarg, "MLFQ", 4) == 0)
+				{
+					scheme = MLFQ;
+					quantum = optarg[4] != '\0' ? atoi(optarg + 4) : 2;
+
+					if (quantum <= 0)
+					{
+						fprintf(stderr, "Option -s <scheme> requires a positive number for the base quantum of MLFQ. (Eg: -s MLFQ2)\n");
+						print_usage(argv[0]);
+						return 1;
+					}
+				}
 				else if (strncasecmp(optarg, "RR", 2) == 0)
 				{
 					scheme = RR;
@@ -118,6 +207,33 @@ int main(int argc, char **argv)
 				}
 				break;
 
+			case 'p':
+				per_core = 1;
+				break;
+
+			case 'q':
+				quiet = 1;
+				break;
+
+			case 'l':
+				log_file_name = optarg;
+				break;
+
+			case 'b':
+			case 'a':
+				if (atoi(optarg) < 0)
+				{
+					fprintf(stderr, "Option -%c requires a non-negative number.\n", c);
+					print_usage(argv[0]);
+					return 1;
+				}
+
+				if (c == 'b')
+					boost_period = atoi(optarg);
+				else
+					aging_limit = atoi(optarg);
+				break;
+
 			case '?':
 				print_usage(argv[0]);
 				return 1;
@@ -142,6 +258,13 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if (per_core && (scheme == CFS || scheme == MLFQ))
+	{
+		fprintf(stderr, "Option -p is not supported with the CFS and MLFQ schemes.\n");
+		print_usage(argv[0]);
+		return 1;
+	}
+
 	if (optind == argc - 1)
 		file_name = argv[optind];
 	else
@@ -195,6 +318,7 @@ int main(int argc, char **argv)
 			jobs[job_id].priority = atoi(priority);
 			jobs[job_id].core_id = -1;
 			jobs[job_id].arrived = 0;
+			jobs[job_id].slot = -1;
 
 			job_id++;
 		}
@@ -208,74 +332,143 @@ int main(int argc, char **argv)
 	fclose(file);
 
 
+	/*
+	 * Open the event log, behind a large buffer so that logging a long trace costs few writes.
+	 */
+	FILE *event_log = NULL;
+	if (log_file_name != NULL)
+	{
+		event_log = fopen(log_file_name, "w");
+		if (event_log == NULL)
+		{
+			fprintf(stderr, "Unable to open file \"%s\".\n", log_file_name);
+			return 2;
+		}
+
+		setvbuf(event_log, NULL, _IOFBF, EVENT_LOG_BUFFER_SIZE);
+		fprintf(event_log, "time,event,job,core\n");
+	}
+
+
 	/*
 	 * Run the simulation.
 	 */
 
-	printf("Loaded %d core(s) and %d job(s) using ", cores, job_id);
-	if (scheme == FCFS) { printf("First Come First Served (FCFS)"); }
-	else if (scheme == SJF) { printf("Non-preemptive Shortest Job First (SJF)"); }
-	else if (scheme == PSJF) { printf("Preemptive Shortest Job First (PSJF)"); }
-	else if (scheme == PRI) { printf("Non-preemptive Priority (PRI)"); }
-	else if (scheme == PPRI) { printf("Preemptive Priority (PPRI)"); }
-	else if (scheme == RR) { printf("Round Robin (RR) with a quantum of %d", quantum); }
-	printf(" scheduling...\n\n");
+	if (!quiet)
+	{
+		printf("Loaded %d core(s) and %d job(s) using ", cores, job_id);
+		if (scheme == FCFS) { printf("First Come First Served (FCFS)"); }
+		else if (scheme == SJF) { printf("Non-preemptive Shortest Job First (SJF)"); }
+		else if (scheme == PSJF) { printf("Preemptive Shortest Job First (PSJF)"); }
+		else if (scheme == PRI) { printf("Non-preemptive Priority (PRI)"); }
+		else if (scheme == PPRI) { printf("Preemptive Priority (PPRI)"); }
+		else if (scheme == RR) { printf("Round Robin (RR) with a quantum of %d", quantum); }
+		else if (scheme == CFS) { printf("Completely Fair Scheduler (CFS)"); }
+		else if (scheme == MLFQ) { printf("Multi-level Feedback Queue (MLFQ) with a base quantum of %d", quantum); }
+		if (per_core) { printf(" with per-core run queues"); }
+		printf(" scheduling...\n\n");
+	}
 
+	scheduler_use_per_core_queues(per_core);
+	scheduler_configure_mlfq(quantum, boost_period, aging_limit);
 	scheduler_start_up(cores, scheme);
 
 
 	int time = 0, i, j;
 	int active_jobs = job_id, jobs_alive = 0;
+	int time_sliced = (scheme == RR || scheme == CFS || scheme == MLFQ);
+
+	/*
+	 * Time jumps from one event to the next: a job arriving, a job finishing
+	 * or a quantum expiring. Arrivals come from the jobs sorted by arrival
+	 * time, and finishes and expiries from the jobs running on each core.
+	 * Jobs that meet an event in the same time unit are handled in the order
+	 * of the active job list, which loses a finished job by moving the last
+	 * job into its slot.
+	 */
+	int *order = malloc(job_id * sizeof(int));
+	int *core_job = malloc(cores * sizeof(int));
+	simulator_job_list_t **arrivals = malloc(job_id * sizeof(simulator_job_list_t *));
+	int next_arrival = 0;
+
+	for (i = 0; i < job_id; i++)
+	{
+		order[i] = i;
+		jobs[i].slot = i;
+		arrivals[i] = &jobs[i];
+	}
+
+	qsort(arrivals, job_id, sizeof(simulator_job_list_t *), compare_arrivals);
 
 	int *quantum_clock = malloc(cores * sizeof(int));
-	char **core_timing_diagram = malloc(cores * sizeof(char *));
-	int core_timing_diagram_size = 1024;
+	timing_span_t **core_spans = malloc(cores * sizeof(timing_span_t *));
+	int *core_span_count = malloc(cores * sizeof(int));
+	int core_span_size = 64;
 
 	for (i = 0; i < cores; i++)
 	{
+		core_job[i] = -1;
 		quantum_clock[i] = -1;
-		core_timing_diagram[i] = malloc(core_timing_diagram_size + 1);
-		core_timing_diagram[i][0] = '\0';
+		core_spans[i] = malloc(core_span_size * sizeof(timing_span_t));
+		core_span_count[i] = 0;
 	}
 
 	while (active_jobs > 0)
 	{
-		printf("=== [TIME %d] ===\n", time);
+		if (!quiet)
+			printf("=== [TIME %d] ===\n", time);
 
 		/*
 		 * 1. Check if any jobs finished in the last time unit.
 		 */
-		for (i = 0; i < active_jobs; i++)
+		while (1)
 		{
-			if (jobs[i].run_time == 0)
+			int finished_job_id = -1;
+
+			for (i = 0; i < cores; i++)
 			{
-				// Notify the scheduler has finished
-				int job_id = jobs[i].job_id;
-				int core_id = jobs[i].core_id;
-				int new_job_id = scheduler_job_finished(jobs[i].core_id, jobs[i].job_id, time);
-
-				if (scheme == RR)
-					quantum_clock[jobs[i].core_id] = quantum;
-
-				// Delete the finished jobs, decrease the number of active jobs
-				if (i != active_jobs - 1)
-					memcpy(&jobs[i], &jobs[active_jobs - 1], sizeof(simulator_job_list_t));
-				active_jobs--;
-				jobs_alive--;
-				i--;
-
-				// Set the new job
-				if ( new_job_id != -1 && !set_active_job(new_job_id, core_id, jobs, active_jobs) )
-				{
-					printf("The scheduler_job_finished() selected an invalid job (job_id == %d).\n", new_job_id);
-					print_available_jobs(jobs, active_jobs);
-					return 3;
-				}
-				else
-				{
-					printf("Job %d, running on core %d, finished. Core %d is now running job %d.\n", job_id, core_id, core_id, new_job_id);
-					printf("  Queue: "); scheduler_show_queue(); printf("\n\n");
-				}
+				int running = core_job[i];
+
+				if (running != -1 && jobs[running].run_time == 0 &&
+						(finished_job_id == -1 || jobs[running].slot < jobs[finished_job_id].slot))
+					finished_job_id = running;
+			}
+
+			if (finished_job_id == -1)
+				break;
+
+			// Notify the scheduler has finished
+			int core_id = jobs[finished_job_id].core_id;
+			int new_job_id = scheduler_job_finished(core_id, finished_job_id, time);
+
+			if (time_sliced)
+				quantum_clock[core_id] = next_quantum(quantum, core_id);
+
+			// Delete the finished jobs, decrease the number of active jobs
+			int last_job_id = order[--active_jobs];
+			order[jobs[finished_job_id].slot] = last_job_id;
+			jobs[last_job_id].slot = jobs[finished_job_id].slot;
+			jobs[finished_job_id].slot = -1;
+			jobs[finished_job_id].core_id = -1;
+			core_job[core_id] = -1;
+			jobs_alive--;
+			log_event(event_log, time, "finish", finished_job_id, core_id);
+
+			// Set the new job
+			if ( new_job_id != -1 && !set_active_job(new_job_id, core_id, jobs, job_id, core_job) )
+			{
+				printf("The scheduler_job_finished() selected an invalid job (job_id == %d).\n", new_job_id);
+				print_available_jobs(jobs, order, active_jobs);
+				return 3;
+			}
+
+			if (new_job_id != -1)
+				log_event(event_log, time, "start", new_job_id, core_id);
+
+			if (!quiet)
+			{
+				printf("Job %d, running on core %d, finished. Core %d is now running job %d.\n", finished_job_id, core_id, core_id, new_job_id);
+				printf("  Queue: "); scheduler_show_queue(); printf("\n\n");
 			}
 		}
 
@@ -288,40 +481,37 @@ int main(int argc, char **argv)
 		/*
 		 * 2. Check of any quantums expired in the last time unit.
 		 */
-		if (scheme == RR)
+		if (time_sliced)
 		{
 			for (i = 0; i < cores; i++)
 			{
-				if (quantum_clock[i] == 0)
+				if (quantum_clock[i] == 0 && core_job[i] != -1)
 				{
-					for (j = 0; j < active_jobs; j++)
-					{
-						if (jobs[j].core_id == i)
-						{
-							// Notify the scheduler the quantum has expired
-							int core_id = jobs[j].core_id;
-							int old_job_id = jobs[j].job_id;
-							int new_job_id = scheduler_quantum_expired(jobs[j].core_id, time);
+					// Notify the scheduler the quantum has expired
+					int old_job_id = core_job[i];
+					int new_job_id = scheduler_quantum_expired(i, time);
 
-							jobs[j].core_id = -1;
+					jobs[old_job_id].core_id = -1;
+					core_job[i] = -1;
 
-							quantum_clock[core_id] = quantum;
+					quantum_clock[i] = next_quantum(quantum, i);
+					log_event(event_log, time, "expire", old_job_id, i);
 
-							// Set the new job
-							if ( new_job_id != -1 && !set_active_job(new_job_id, core_id, jobs, active_jobs) )
-							{
-								printf("The scheduler_quantum_expired() selected an invalid job (job_id == %d).\n", new_job_id);
-								print_available_jobs(jobs, active_jobs);
-								return 3;
-							}
-							else
-							{
-								printf("Job %d, running on core %d, had its quantum expire. Core %d is now running job %d.\n", old_job_id, core_id, core_id, new_job_id);
-								printf("  Queue: "); scheduler_show_queue(); printf("\n\n");
-							}
+					// Set the new job
+					if ( new_job_id != -1 && !set_active_job(new_job_id, i, jobs, job_id, core_job) )
+					{
+						printf("The scheduler_quantum_expired() selected an invalid job (job_id == %d).\n", new_job_id);
+						print_available_jobs(jobs, order, active_jobs);
+						return 3;
+					}
 
-							break;
-						}
+					if (new_job_id != -1)
+						log_event(event_log, time, "start", new_job_id, i);
+
+					if (!quiet)
+					{
+						printf("Job %d, running on core %d, had its quantum expire. Core %d is now running job %d.\n", old_job_id, i, i, new_job_id);
+						printf("  Queue: "); scheduler_show_queue(); printf("\n\n");
 					}
 				}
 			}
@@ -331,156 +521,239 @@ int main(int argc, char **argv)
 		/*
 		 * 3. Check for any new jobs that arrive in this time unit
 		 */
-		for (i = 0; i < active_jobs; i++)
+		while (next_arrival < job_id && arrivals[next_arrival]->arrival_time < time)
+			next_arrival++;
+
+		int arrived = next_arrival;
+		while (arrived < job_id && arrivals[arrived]->arrival_time == time)
 		{
-			if (jobs[i].arrival_time == time)
+			// Keep jobs arriving together in active job list order
+			for (j = arrived; j > next_arrival && arrivals[j - 1]->slot > arrivals[j]->slot; j--)
 			{
-				int new_job_core_id = scheduler_new_job(jobs[i].job_id, time, jobs[i].run_time, jobs[i].priority);
-				jobs[i].arrived = 1;
-				jobs_alive++;
+				simulator_job_list_t *swap = arrivals[j];
+				arrivals[j] = arrivals[j - 1];
+				arrivals[j - 1] = swap;
+			}
 
-				if (new_job_core_id >= 0 && new_job_core_id < cores)
+			arrived++;
+		}
+
+		for (; next_arrival < arrived; next_arrival++)
+		{
+			simulator_job_list_t *job = arrivals[next_arrival];
+			int new_job_core_id = scheduler_new_job(job->job_id, time, job->run_time, job->priority);
+			job->arrived = 1;
+			jobs_alive++;
+			log_event(event_log, time, "arrive", job->job_id, -1);
+
+			if (new_job_core_id >= 0 && new_job_core_id < cores)
+			{
+				if (!quiet)
 				{
 					printf("A new job, job %d (running time=%d, priority=%d), arrived. Job %d is now running on core %d.\n",
-							jobs[i].job_id, jobs[i].run_time, jobs[i].priority, jobs[i].job_id, new_job_core_id);
+							job->job_id, job->run_time, job->priority, job->job_id, new_job_core_id);
 					printf("  Queue: "); scheduler_show_queue(); printf("\n\n");
+				}
 
-					// Find if anyone is currently using the core.
-					for (j = 0; j < active_jobs; j++)
-						if (jobs[j].core_id == new_job_core_id)
-							jobs[j].core_id = -1;
+				// Find if anyone is currently using the core.
+				if (core_job[new_job_core_id] != -1)
+				{
+					log_event(event_log, time, "preempt", core_job[new_job_core_id], new_job_core_id);
+					jobs[core_job[new_job_core_id]].core_id = -1;
+				}
 
-					// Assign the core to the new job
-					jobs[i].core_id = new_job_core_id;
+				log_event(event_log, time, "start", job->job_id, new_job_core_id);
 
-					if (scheme == RR)
-						quantum_clock[new_job_core_id] = quantum;
-				}
-				else if (new_job_core_id == -1)
+				// Assign the core to the new job
+				set_active_job(job->job_id, new_job_core_id, jobs, job_id, core_job);
+
+				if (time_sliced)
+					quantum_clock[new_job_core_id] = next_quantum(quantum, new_job_core_id);
+			}
+			else if (new_job_core_id == -1)
+			{
+				if (!quiet)
 				{
 					printf("A new job, job %d (running time=%d, priority=%d), arrived. Job %d is set to idle (-1).\n",
-							jobs[i].job_id, jobs[i].run_time, jobs[i].priority, jobs[i].job_id);
+							job->job_id, job->run_time, job->priority, job->job_id);
 					printf("  Queue: "); scheduler_show_queue(); printf("\n\n");
 				}
-				else
-				{
-					printf("The scheduler_new_job() selected an invalid core (core_id == %d).\n", new_job_core_id);
-					print_available_cores(cores);
-					return 3;
-				}
+			}
+			else
+			{
+				printf("The scheduler_new_job() selected an invalid core (core_id == %d).\n", new_job_core_id);
+				print_available_cores(cores);
+				return 3;
 			}
 		}
 
 
 		/*
-		 * 4. Run the time unit.
+		 * 4. Run the time units up to the next event.  Until then, only the
+		 *    timing diagram changes.
 		 */
-		char time_string[cores][11];
 		int cores_working = 0;
+		int next_time = INT_MAX;
+
+		if (next_arrival < job_id)
+			next_time = arrivals[next_arrival]->arrival_time;
 
 		for (i = 0; i < cores; i++)
-			time_string[i][0] = '\0';
+		{
+			int running = core_job[i];
 
-		for (i = 0; i < active_jobs; i++)
+			if (running == -1)
+				continue;
+
+			cores_working++;
+
+			if (time + jobs[running].run_time < next_time)
+				next_time = time + jobs[running].run_time;
+			if (time_sliced && time + quantum_clock[i] < next_time)
+				next_time = time + quantum_clock[i];
+		}
+
+		// Run a single time unit when no event lies ahead or the sanity check is about to fail
+		if (next_time <= time || next_time == INT_MAX || (jobs_alive > 0 && cores_working == 0))
+			next_time = time + 1;
+
+		int units = next_time - time;
+
+		for (i = 0; i < cores; i++)
 		{
-			if (jobs[i].core_id != -1)
+			if (core_job[i] != -1)
 			{
-				cores_working++;
-				jobs[i].run_time--;
-				quantum_clock[jobs[i].core_id]--;
-
-				assert(time_string[jobs[i].core_id][0] == '\0');
-
-				if (jobs[i].job_id < 10)
-					sprintf(time_string[jobs[i].core_id], "%d", jobs[i].job_id);
-				else if (jobs[i].job_id < 10 + 26)
-					sprintf(time_string[jobs[i].core_id], "%c", jobs[i].job_id - 10 + 'a');
-				else if (jobs[i].job_id < 10 + 26 + 26)
-					sprintf(time_string[jobs[i].core_id], "%c", jobs[i].job_id - 10 - 26 + 'A');
-				else
-					snprintf(time_string[jobs[i].core_id], 10, "(%d)", jobs[i].job_id);
+				jobs[core_job[i]].run_time -= units;
+				quantum_clock[i] -= units;
 			}
 		}
 
-		for (i = 0; i < cores; i++)
+		if (!quiet)
 		{
-			// If the core is idle, print a '-'
-			if (time_string[i][0] == '\0')
-				strcpy(time_string[i], "-");
+			/*
+			 * 5. Print data!  Each core shows only what it ran since the last
+			 *    event.  The diagram is kept as one span per run of a job and
+			 *    printed whole once, at the end.
+			 */
+			if (units == 1)
+				printf("At the end of time unit %d...\n", time);
+			else
+				printf("At the end of time units %d to %d...\n", time, next_time - 1);
 
-			// Ensure we have enough memory
-			while (strlen(core_timing_diagram[i]) + strlen(time_string[i]) >= (unsigned int)core_timing_diagram_size)
+			for (i = 0; i < cores; i++)
 			{
-				core_timing_diagram_size *= 2;
+				int last = core_span_count[i] - 1;
 
-				for (j = 0; j < cores; j++)
+				if (last >= 0 && core_spans[i][last].job_id == core_job[i])
+					core_spans[i][last].units += units;
+				else
 				{
-					core_timing_diagram[j] = realloc(core_timing_diagram[j], core_timing_diagram_size + 1);
-
-					if (core_timing_diagram[j] == NULL)
+					// Ensure we have enough memory
+					if (core_span_count[i] == core_span_size)
 					{
-						fprintf(stderr, "Out of memory.\n");
-						return 3;
-					}
-				}
-			}
+						core_span_size *= 2;
 
-			strcat( core_timing_diagram[i], time_string[i] );
-		}
+						for (j = 0; j < cores; j++)
+						{
+							core_spans[j] = realloc(core_spans[j], core_span_size * sizeof(timing_span_t));
 
+							if (core_spans[j] == NULL)
+							{
+								fprintf(stderr, "Out of memory.\n");
+								return 3;
+							}
+						}
+					}
 
-		/*
-		 * 5. Print data!
-		 */
-		printf("At the end of time unit %d...\n", time);
+					core_spans[i][core_span_count[i]].job_id = core_job[i];
+					core_spans[i][core_span_count[i]].units = units;
+					core_span_count[i]++;
+				}
 
-		for (i = 0; i < cores; i++)
-			printf("  Core %2d: %s\n", i, core_timing_diagram[i]);
+				printf("  Core %2d: ", i);
+				print_span(core_job[i], units);
+				printf("\n");
+			}
 
-		printf("\n");
+			printf("\n");
 
-		printf("  Queue: ");
-		scheduler_show_queue();
-		printf("\n");
-		printf("\n");
+			printf("  Queue: ");
+			scheduler_show_queue();
+			printf("\n");
+			printf("\n");
+		}
 
 
 		/*
 		 * 6. Sanity Checking
 		 *
 		 * - If there's a job alive (needing to be ran) and all CPUs are idle, the scheduler failed to schedule properly.
+		 * - If nothing is running and no job is left to arrive, the remaining jobs can never run.
 		 */
 		if (jobs_alive > 0 && cores_working == 0)
 		{
 			printf("All cores are idle and at least one job remains unscheduled.\n");
-			print_available_jobs(jobs, active_jobs);
+			print_available_jobs(jobs, order, active_jobs);
+			return 3;
+		}
+
+		if (cores_working == 0 && next_arrival == job_id)
+		{
+			printf("All cores are idle and at least one job can never arrive.\n");
 			return 3;
 		}
 
 
 		/*
-		 * 7. Increase time
+		 * 7. Increase time, straight to the next event
 		 */
-		time++;
+		time = next_time;
 	}
 
 
-	printf("FINAL TIMING DIAGRAM:\n");
-	for (i = 0; i < cores; i++)
-		printf("  Core %2d: %s\n", i, core_timing_diagram[i]);
+	if (!quiet)
+	{
+		printf("FINAL TIMING DIAGRAM:\n");
+		for (i = 0; i < cores; i++)
+		{
+			printf("  Core %2d: ", i);
+			for (j = 0; j < core_span_count[i]; j++)
+				print_span(core_spans[i][j].job_id, core_spans[i][j].units);
+			printf("\n");
+		}
+
+		printf("\n");
+	}
 
-	printf("\n");
 	printf("Average Waiting Time: %.2f\n", scheduler_average_waiting_time());
 	printf("Average Turnaround Time: %.2f\n", scheduler_average_turnaround_time());
 	printf("Average Response Time: %.2f\n", scheduler_average_response_time());
 
+	if (per_core)
+	{
+		printf("\n");
+		printf("Migrations: %d\n", scheduler_migrations());
+		printf("Average Queue Imbalance: %.2f\n", scheduler_average_imbalance());
+		printf("Maximum Queue Imbalance: %d\n", scheduler_max_imbalance());
+	}
+
 	scheduler_clean_up();
 
+	if (event_log != NULL && fclose(event_log) != 0)
+	{
+		fprintf(stderr, "Unable to write file \"%s\".\n", log_file_name);
+		return 2;
+	}
+
 
 	free(quantum_clock);
 	for (i=0; i < cores; i++)
-		free(core_timing_diagram[i]);
-	free(core_timing_diagram);
+		free(core_spans[i]);
+	free(core_spans);
+	free(core_span_count);
+	free(core_job);
+	free(arrivals);
+	free(order);
 	free(jobs);
 
 	return 0;
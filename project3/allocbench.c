@@ -0,0 +1,357 @@
+/**
+ * Allocator comparison benchmark
+ *
+ * Replays one allocation trace (the format read by `./buddy -t`) against the
+ * buddy allocator, glibc malloc and the bucket allocator from bash's
+ * lib/malloc, all driven through the same alloc/free interface. Each
+ * allocator runs in its own child process so that their heaps and resident
+ * set sizes do not mix.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "trace.h"
+
+/**
+ * Bytes between the bytes written into each block, so every page that the
+ * caller asked for becomes resident
+ */
+#define TOUCH_STRIDE 4096
+
+/**
+ * Common interface over the allocators being compared
+ */
+typedef struct allocator_t {
+	const char* name;             ///< Name printed in the report
+	int (*init)();                ///< Set up the allocator, 0 on success
+	void* (*alloc)(size_t size);  ///< Allocate a block
+	void (*free)(void* ptr);      ///< Free a block
+} allocator_t;
+
+/**
+ * Results of one allocator, passed from the child to the parent
+ */
+typedef struct result_t {
+	double ops_per_sec;     ///< Throughput of the untimed-per-op pass
+	double p50, p99, p999;  ///< Latency percentiles in ns
+	double max;             ///< Slowest operation in ns
+	long rss_kib;           ///< Growth of the peak resident set in KiB
+	long failed;            ///< Allocations that returned NULL
+} result_t;
+
+/* bash's lib/malloc, built with its entry points renamed */
+extern void* bash_malloc(size_t size);
+extern void bash_free(void* ptr);
+
+static int arena_order = 30;       // Order of the buddy arena
+static int page_order = 12;        // Order of the buddy arena's smallest block
+static int map_flags = 0;          // Flags for buddy_map_region()
+static buddy_arena_t* arena = NULL;
+
+static int buddy_bench_init()
+{
+	void* memory = buddy_map_region(1UL << arena_order, map_flags);
+
+	if (memory == NULL)
+		return -1;
+
+	arena = buddy_arena_create(memory, 1UL << arena_order, page_order);
+	return arena != NULL ? 0 : -1;
+}
+
+static void* buddy_bench_alloc(size_t size)
+{
+	return buddy_arena_alloc(arena, size);
+}
+
+static void buddy_bench_free(void* ptr)
+{
+	buddy_arena_free(arena, ptr);
+}
+
+static int no_init()
+{
+	return 0;
+}
+
+static const allocator_t allocators[] = {
+	{ "buddy", buddy_bench_init, buddy_bench_alloc, buddy_bench_free },
+	{ "glibc", no_init, malloc, free },
+	{ "bash", no_init, bash_malloc, bash_free },
+};
+
+#define N_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+/**
+ * Nanoseconds between two timestamps
+ */
+static inline double elapsed_ns(const struct timespec* start, const struct timespec* end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/**
+ * Run a trace once against an allocator
+ *
+ * Blocks still live at the end of the trace are freed afterwards, outside of
+ * any measurement. When latencies are recorded, each allocated block is also
+ * written once per TOUCH_STRIDE bytes, between the timed calls, so that the
+ * resident set grows as it would for a real caller.
+ *
+ * @param a Allocator to use
+ * @param ops Trace to run
+ * @param n_ops Number of operations in the trace
+ * @param blocks Handle table, all NULL on entry and on return
+ * @param n_handles Number of entries in the handle table
+ * @param latency If not NULL, receives the time of each operation in ns,
+ * and allocated blocks are touched
+ * @return Number of failed allocations
+ */
+static long run_trace(const allocator_t* a, const trace_op_t* ops, size_t n_ops,
+                      void** blocks, size_t n_handles, float* latency)
+{
+	struct timespec start, end;
+	long failed = 0;
+	size_t i, off;
+
+	for (i = 0; i < n_ops; ++i) {
+		const trace_op_t* op = &ops[i];
+		void** block = &blocks[op->handle];
+		void* old = *block;
+
+		if (latency != NULL)
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (op->op == 'a') {
+			if (old != NULL)
+				a->free(old);
+
+			*block = a->alloc(op->size);
+		}
+		else if (old != NULL) {
+			a->free(old);
+			*block = NULL;
+		}
+
+		if (latency != NULL) {
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			latency[i] = elapsed_ns(&start, &end);
+		}
+
+		if (op->op == 'a' && *block == NULL)
+			++failed;
+
+		// A real caller writes to what it allocates
+		if (latency != NULL && op->op == 'a' && *block != NULL)
+			for (off = 0; off < op->size; off += TOUCH_STRIDE)
+				((char*)*block)[off] = 1;
+	}
+
+	for (i = 0; i < n_handles; ++i) {
+		if (blocks[i] != NULL) {
+			a->free(blocks[i]);
+			blocks[i] = NULL;
+		}
+	}
+
+	return failed;
+}
+
+/**
+ * Order floats for qsort
+ */
+static int compare_float(const void* a, const void* b)
+{
+	float x = *(const float*)a, y = *(const float*)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Peak resident set size of this process in KiB
+ */
+static long peak_rss()
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+/**
+ * Measure one allocator
+ *
+ * The trace is run twice: once timed as a whole for throughput, and once
+ * timing every operation for the latency distribution. Only the second run
+ * writes to the blocks, so throughput counts allocator calls alone and the
+ * peak resident set still covers the memory a caller would use.
+ *
+ * @param a Allocator to measure
+ * @param ops Trace to run
+ * @param n_ops Number of operations in the trace
+ * @param n_handles Number of handles the trace uses
+ * @param result Receives the measurements
+ * @return 0 on success, -1 if the allocator could not be set up
+ */
+static int bench(const allocator_t* a, const trace_op_t* ops, size_t n_ops,
+                 size_t n_handles, result_t* result)
+{
+	// Fault in the bookkeeping first so it is not counted against the allocator
+	void** blocks = malloc(n_handles * sizeof(void*));
+	float* latency = malloc(n_ops * sizeof(float));
+	struct timespec start, end;
+
+	if (blocks == NULL || latency == NULL)
+		return -1;
+
+	memset(blocks, 0, n_handles * sizeof(void*));
+	memset(latency, 0, n_ops * sizeof(float));
+	long rss_before = peak_rss();
+
+	if (a->init() != 0)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	result->failed = run_trace(a, ops, n_ops, blocks, n_handles, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	run_trace(a, ops, n_ops, blocks, n_handles, latency);
+	result->rss_kib = peak_rss() - rss_before;
+
+	double ns = elapsed_ns(&start, &end);
+	result->ops_per_sec = ns > 0 ? n_ops / ns * 1e9 : 0.0;
+
+	qsort(latency, n_ops, sizeof(float), compare_float);
+	result->p50 = n_ops ? latency[n_ops / 2] : 0.0;
+	result->p99 = n_ops ? latency[(size_t)(n_ops * 0.99)] : 0.0;
+	result->p999 = n_ops ? latency[(size_t)(n_ops * 0.999)] : 0.0;
+	result->max = n_ops ? latency[n_ops - 1] : 0.0;
+
+	free(latency);
+	free(blocks);
+	return 0;
+}
+
+/**
+ * Measure one allocator in a child process
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int bench_in_child(const allocator_t* a, const trace_op_t* ops, size_t n_ops,
+                          size_t n_handles, result_t* result)
+{
+	int fds[2];
+	int status;
+	pid_t pid;
+
+	if (pipe(fds) != 0)
+		return -1;
+
+	pid = fork();
+
+	if (pid < 0)
+		return -1;
+
+	if (pid == 0) {
+		close(fds[0]);
+		int ok = bench(a, ops, n_ops, n_handles, result) == 0
+			&& write(fds[1], result, sizeof(result_t)) == sizeof(result_t);
+		_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	close(fds[1]);
+	ssize_t got = read(fds[0], result, sizeof(result_t));
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+
+	return got == sizeof(result_t) && WIFEXITED(status)
+		&& WEXITSTATUS(status) == EXIT_SUCCESS ? 0 : -1;
+}
+
+/**
+ * Output program manual
+ *
+ * @param prog_name Name of the program passed in as a command line argument.
+ * @param out File stream to write to.
+ */
+void print_usage(char* prog_name, FILE* out)
+{
+	fprintf(out, "Usage:\n");
+	fprintf(out, "  ./%s [-i trace] [-a order] [-p order] [-H]\n", prog_name);
+	fprintf(out, "     -i - Trace to replay (default: stdin)\n");
+	fprintf(out, "     -a - Order of the buddy arena size (default: %d)\n", arena_order);
+	fprintf(out, "     -p - Order of the buddy page size (default: %d)\n", page_order);
+	fprintf(out, "     -H - Back the buddy arena with transparent huge pages\n");
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+	FILE* in = stdin;
+	trace_op_t* ops;
+	size_t n_ops, n_handles;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "i:a:p:H")) != -1) {
+		switch (opt) {
+		case 'i':
+			in = fopen(optarg, "r");
+			if (in == NULL) {
+				perror("ERROR: Failed to open trace");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'a':
+			arena_order = atoi(optarg);
+			break;
+		case 'p':
+			page_order = atoi(optarg);
+			break;
+		case 'H':
+			map_flags |= BUDDY_MAP_HUGEPAGE;
+			break;
+		default:
+			print_usage(argv[0], stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (arena_order < page_order || arena_order > 40 || page_order < 1) {
+		print_usage(argv[0], stderr);
+		return EXIT_FAILURE;
+	}
+
+	if (trace_load(in, &ops, &n_ops, &n_handles) != TRACE_OK)
+		return EXIT_FAILURE;
+
+	if (in != stdin)
+		fclose(in);
+
+	printf("%-8s %14s %10s %10s %10s %10s %12s %8s\n", "alloc", "ops/s",
+	       "p50 ns", "p99 ns", "p99.9 ns", "max ns", "peak RSS KiB", "failed");
+
+	for (i = 0; i < N_ALLOCATORS; ++i) {
+		result_t r;
+
+		fflush(stdout);
+
+		if (bench_in_child(&allocators[i], ops, n_ops, n_handles, &r) != 0) {
+			fprintf(stderr, "ERROR: %s benchmark failed\n", allocators[i].name);
+			continue;
+		}
+
+		printf("%-8s %14.0f %10.0f %10.0f %10.0f %10.0f %12ld %8ld\n", allocators[i].name,
+		       r.ops_per_sec, r.p50, r.p99, r.p999, r.max, r.rss_kib, r.failed);
+	}
+
+	free(ops);
+	return EXIT_SUCCESS;
+}
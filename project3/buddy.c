@@ -1,7 +1,9 @@
 /**
  * Buddy Allocator
  *
- * For the list library usage, see http://www.mcs.anl.gov/~kazutomo/list/
+ * Page metadata is a flat array of packed descriptors. Free lists are linked
+ * through page indexes rather than pointers, and a page's address is computed
+ * from its index.
  */
 
 /**************************************************************************
@@ -9,31 +11,110 @@
  **************************************************************************/
 #define USE_DEBUG 0
 
+/* checked build: validate every free, poison freed blocks and guard the
+ * slack after each allocation with a canary (build with -DUSE_CHECKED=1) */
+#ifndef USE_CHECKED
+#define USE_CHECKED 0
+#endif
+
+/* sched_getcpu() */
+#define _GNU_SOURCE
+
 /**************************************************************************
  * Included Files
  **************************************************************************/
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "buddy.h"
-#include "list.h"
 
 /**************************************************************************
  * Public Definitions
  **************************************************************************/
+/* order range of the default arena used by buddy_init() */
 #define MIN_ORDER 12
 #define MAX_ORDER 20
 
-#define PAGE_SIZE (1<<MIN_ORDER)
+/* largest order any arena may have, bounded by the width of free_mask */
+#define ORDER_LIMIT ((int)(sizeof(unsigned long) * 8) - 1)
+
+/* state of a block's head page */
+#define PAGE_IN_USE 0   /* allocated, per-CPU cached or not a block head */
+#define PAGE_FREE 1     /* on free_area[block_size_order] */
+#define BULK_PENDING -1 /* freed by a batch that has not been coalesced yet */
+#define PAGE_GUARDED 2  /* allocated with a canary trailer (checked builds) */
+#define PAGE_PURGING 3  /* free, but off the free lists while it is purged */
+
+/* pages held by a per-CPU cache before it drains to the free lists */
+#define PCP_HIGH 64
+
+/* pages moved between a per-CPU cache and the free lists at a time */
+#define PCP_BATCH 16
+
+/* decay_epoch of a free block whose pages have been returned to the OS */
+#define PURGED 0x3f
+
+/* decay epochs run 0 .. EPOCHS - 1 and wrap, never reaching PURGED */
+#define EPOCHS PURGED
+
+/* number of epochs from a to b, allowing for wraparound */
+#define EPOCH_AGE(a, b) (((b) + EPOCHS - (a)) % EPOCHS)
+
+/* is decay epoch a earlier than b, allowing for wraparound */
+#define EPOCH_BEFORE(a, b) (EPOCH_AGE(a, b) != 0 && EPOCH_AGE(a, b) < EPOCHS / 2)
+
+/* free blocks taken off the free lists per round of a purge */
+#define PURGE_BATCH 64
+
+/* does a block of order o advance the decay clock */
+#define DECAY_DUE(a, o) ((a)->decay_order >= 0 && (o) >= (a)->decay_order)
+
+/* width of a page index in page_t; an arena has at most 2^(PAGE_INDEX_BITS-1) pages */
+#define PAGE_INDEX_BITS 24
+
+/* end of a free list */
+#define NIL ((1U<<PAGE_INDEX_BITS) - 1)
+
+/* size of a transparent huge page on x86-64 */
+#define HUGE_PAGE_SIZE (1UL<<21)
+
+#define PAGE_SIZE(a) (1UL<<(a)->min_order)
 /* page index to address */
-#define PAGE_TO_ADDR(page_idx) (void *)((page_idx*PAGE_SIZE) + g_memory)
+#define PAGE_TO_ADDR(a, page_idx) (void *)(((unsigned long)(page_idx) << (a)->min_order) + (a)->memory)
 
 /* address to page index */
-#define ADDR_TO_PAGE(addr) ((unsigned long)((void *)addr - (void *)g_memory) / PAGE_SIZE)
+#define ADDR_TO_PAGE(a, addr) ((unsigned long)((char *)(addr) - (a)->memory) >> (a)->min_order)
 
 /* find buddy address */
-#define BUDDY_ADDR(addr, o) (void *)((((unsigned long)addr - (unsigned long)g_memory) ^ (1<<o)) \
-									 + (unsigned long)g_memory)
+#define BUDDY_ADDR(a, addr, o) (void *)((((unsigned long)addr - (unsigned long)(a)->memory) ^ (1UL<<o)) \
+									 + (unsigned long)(a)->memory)
+
+/* smallest order holding size bytes (size > 1) */
+#define ORDER_OF(size) ((int)(sizeof(unsigned long) * 8) - __builtin_clzl((unsigned long)(size) - 1))
+
+/* page descriptor to page index */
+#define PAGE_INDEX(a, page) ((int)((page) - (a)->pages))
+
+/* find buddy page index */
+#define BUDDY_INDEX(a, page_idx, o) ((page_idx) ^ (1 << ((o) - (a)->min_order)))
+
+#if USE_CHECKED
+/* byte written over every freed block */
+#  define POISON_FREE 0x6b
+/* byte written into the red zone right after each guarded allocation */
+#  define REDZONE_BYTE 0xa5
+/* largest red zone checked on free */
+#  define REDZONE_SIZE 64
+/* trailer canary, mixed with the block address */
+#  define CANARY 0x5a17c0debadc0ffeUL
+#endif
 
 #if USE_DEBUG == 1
 #  define PDEBUG(fmt, ...) \
@@ -48,30 +129,136 @@
 /**************************************************************************
  * Public Types
  **************************************************************************/
+/**
+ * Packed descriptor of one page, a single 8-byte word
+ *
+ * Only the head page of a block carries meaningful state. Every field is
+ * only written under the arena lock, or by the thread owning the block.
+ */
 typedef struct {
-	struct list_head list;
+	// Neighbours on the free list, as page indexes (NIL at either end)
+	uint64_t next : PAGE_INDEX_BITS;
+	uint64_t prev : PAGE_INDEX_BITS;
 
-	// Integer to hold the order size the current block
-	int block_size_order;
+	// Order of the block this page heads, -1 if it heads none
+	int64_t block_size_order : 7;
 
-	// The index of this page
-	int index;
+	// One of the PAGE_* states or BULK_PENDING
+	int64_t state : 3;
 
-	// The address of this page
-	char *block_addr;
+	// On the head page of a free block: the decay epoch in which the block
+	// was last dirtied, or PURGED once its pages went back to the OS. Decay
+	// purges blocks at or above its order within two epochs, so their epochs
+	// stay close to the current one. A stale epoch from a smaller block can
+	// at worst make a merged block look young and put off its purge.
+	uint64_t decay_epoch : 6;
 } page_t;
 
+_Static_assert(sizeof(page_t) == 8, "page_t must pack into one word");
+
+/**
+ * Per-CPU cache of free pages of the smallest order
+ *
+ * Like the Linux per-cpu page lists, most single-page allocations and frees
+ * are served from here without taking the arena lock. The lock only guards
+ * against a thread migrating to another CPU mid-operation, so it is nearly
+ * always uncontended.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+
+	// Number of cached pages
+	int count;
+
+	// Indexes of the cached pages, most recently freed last
+	int pages[PCP_HIGH];
+} __attribute__((aligned(64))) pcp_t;
+
+/**
+ * Event and byte counters behind buddy_arena_stats()
+ *
+ * In concurrent mode these are updated with atomic adds, since the per-CPU
+ * cache paths do not hold the arena lock.
+ */
+typedef struct {
+	unsigned long bytes_in_use;
+	unsigned long high_water;
+	unsigned long bytes_requested;
+	unsigned long bytes_granted;
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long splits;
+	unsigned long merges;
+	unsigned long failed;
+	unsigned long bytes_released;
+} counters_t;
+
+/**
+ * All state of one buddy arena
+ */
+struct buddy_arena {
+	/* free lists, as the index of their first page (NIL if empty) */
+	uint32_t free_area[ORDER_LIMIT+1];
+
+	/* bit o is set while free_area[o] is non-empty */
+	unsigned long free_mask;
+
+	/* number of blocks on each free list */
+	unsigned long nr_free[ORDER_LIMIT+1];
+
+	/* statistics */
+	counters_t stats;
+
+	/* order range of this arena */
+	int min_order;
+	int max_order;
+
+	/* memory area */
+	char *memory;
+
+	/* page structures */
+	page_t *pages;
+
+	/* non-zero once buddy_arena_set_concurrent() has been called */
+	int concurrent;
+
+	/* guards the free lists in concurrent mode */
+	pthread_mutex_t lock;
+
+	/* per-CPU page caches, n_pcp of them */
+	pcp_t *pcp;
+	int n_pcp;
+
+	/* free blocks of at least decay_order are purged once they have been
+	 * idle for a full decay period; -1 disables decay */
+	int decay_order;
+	long decay_ms;
+
+	/* current decay epoch (never PURGED) and when it started, in ms */
+	uint16_t epoch;
+	long epoch_start;
+};
+
+#if USE_CHECKED
+/**
+ * Trailer in the last bytes of a guarded block
+ */
+typedef struct {
+	size_t size;           // bytes the caller asked for
+	unsigned long canary;  // CANARY ^ block address
+} guard_t;
+#endif
+
 /**************************************************************************
  * Global Variables
  **************************************************************************/
-/* free lists*/
-struct list_head free_area[MAX_ORDER+1];
+/* arena behind buddy_init(), buddy_alloc(), buddy_free() and buddy_dump() */
+static buddy_arena_t default_arena;
 
-/* memory area */
-char g_memory[1<<MAX_ORDER];
-
-/* page structures */
-page_t g_pages[(1<<MAX_ORDER)/PAGE_SIZE];
+/* backing store for the default arena, aligned to its size so that every
+ * block is aligned to its own size */
+static char default_memory[1<<MAX_ORDER] __attribute__((aligned(1<<MAX_ORDER)));
+static page_t default_pages[(1<<MAX_ORDER)/(1<<MIN_ORDER)];
 
 /**************************************************************************
  * Public Function Prototypes
@@ -82,210 +269,1627 @@ page_t g_pages[(1<<MAX_ORDER)/PAGE_SIZE];
  **************************************************************************/
 
 /**
- * Initialize the buddy system
+ * Put a block on the free list of the given order
+ *
+ * The head page is tagged with its order and free state so that buddy_free()
+ * can check a buddy in constant time instead of searching the free list.
+ *
+ * @param arena arena owning the block
+ * @param page head page of the block
+ * @param order order of the block
  */
-void buddy_init()
+static inline void free_area_add(buddy_arena_t *arena, page_t *page, int order)
+{
+	uint32_t head = arena->free_area[order];
+
+	page->block_size_order = order;
+	page->state = PAGE_FREE;
+	page->prev = NIL;
+	page->next = head;
+	if(head != NIL)
+		arena->pages[head].prev = PAGE_INDEX(arena, page);
+	arena->free_area[order] = PAGE_INDEX(arena, page);
+	arena->free_mask |= 1UL << order;
+	arena->nr_free[order]++;
+}
+
+/**
+ * Take a block off the free list it is currently on
+ *
+ * @param arena arena owning the block
+ * @param page head page of the block
+ */
+static inline void free_area_del(buddy_arena_t *arena, page_t *page)
+{
+	int order = page->block_size_order;
+
+	page->state = PAGE_IN_USE;
+
+	if(page->prev != NIL)
+		arena->pages[page->prev].next = page->next;
+	else
+		arena->free_area[order] = page->next;
+
+	if(page->next != NIL)
+		arena->pages[page->next].prev = page->prev;
+
+	arena->nr_free[order]--;
+
+	if(arena->free_area[order] == NIL)
+		arena->free_mask &= ~(1UL << order);
+}
+
+/**
+ * Check the arguments of an arena and compute its largest order
+ *
+ * @param base start of the memory region to manage
+ * @param size size of the region in bytes
+ * @param min_order order of the smallest block
+ * @return the largest order of the arena
+ * @return -1 if the arguments are invalid
+ */
+static int arena_max_order(void *base, size_t size, int min_order)
+{
+	int max_order;
+
+	if(base == NULL || size == 0 || (size & (size - 1)) != 0 || min_order < 0)
+		return -1;
+
+	max_order = __builtin_ctzl(size);
+
+	// Page indexes must fit page_t, leaving NIL unused
+	if(max_order < min_order || max_order > ORDER_LIMIT
+	   || max_order - min_order > PAGE_INDEX_BITS - 1)
+		return -1;
+
+	return max_order;
+}
+
+/**
+ * Reset an arena so the whole region is a single free block
+ *
+ * @param arena arena to set up
+ * @param base start of the memory region to manage
+ * @param max_order order of the region
+ * @param min_order order of the smallest block
+ * @param pages page metadata, one entry per page of the region
+ */
+static void arena_setup(buddy_arena_t *arena, void *base, int max_order, int min_order,
+						page_t *pages)
 {
 	int i;
-	int n_pages = (1<<MAX_ORDER) / PAGE_SIZE;
+	int n_pages = 1 << (max_order - min_order);
 
-	for (i = 0; i < n_pages; i++) {
-		// Initialize the page list
-		INIT_LIST_HEAD(&g_pages[i].list);
+	arena->memory = base;
+	arena->pages = pages;
+	arena->min_order = min_order;
+	arena->max_order = max_order;
+	arena->concurrent = 0;
+	arena->pcp = NULL;
+	arena->n_pcp = 0;
+	arena->decay_order = -1;
+	arena->decay_ms = 0;
+	arena->epoch = 0;
+	arena->epoch_start = 0;
 
-		// Initialize the page variables
-		g_pages[i].block_size_order = -1;
-		g_pages[i].index = i;
-		g_pages[i].block_addr = PAGE_TO_ADDR(i);
+	for (i = 0; i < n_pages; i++) {
+		pages[i].next = NIL;
+		pages[i].prev = NIL;
+		pages[i].block_size_order = -1;
+		pages[i].state = PAGE_IN_USE;
+		pages[i].decay_epoch = PURGED;
 	}
-	// To begin, it's all one block
-	g_pages[0].block_size_order = MAX_ORDER;
 
 	/* initialize freelist */
-	for (i = MIN_ORDER; i <= MAX_ORDER; i++) {
-		INIT_LIST_HEAD(&free_area[i]);
+	for (i = min_order; i <= max_order; i++) {
+		arena->free_area[i] = NIL;
+		arena->nr_free[i] = 0;
 	}
+	arena->free_mask = 0;
+	memset(&arena->stats, 0, sizeof(arena->stats));
 
-	/* add the entire memory as a freeblock */
-	list_add(&g_pages[0].list, &free_area[MAX_ORDER]);
+	/* add the entire memory as a freeblock, not yet touched */
+	free_area_add(arena, &pages[0], max_order);
 }
 
 /**
- * Allocate a memory block.
+ * Release the locks and per-CPU caches of a concurrent arena
  *
- * On a memory request, the allocator returns the head of a free-list of the
- * matching size (i.e., smallest block that satisfies the request). If the
- * free-list of the matching block size is empty, then a larger block size will
- * be selected. The selected (large) block is then splitted into two smaller
- * blocks. Among the two blocks, left block will be used for allocation or be
- * further splitted while the right block will be added to the appropriate
- * free-list.
+ * @param arena arena to tear down
+ */
+static void arena_teardown(buddy_arena_t *arena)
+{
+	int i;
+
+	if(!arena->concurrent)
+		return;
+
+	for(i = 0; i < arena->n_pcp; i++)
+		pthread_mutex_destroy(&arena->pcp[i].lock);
+
+	pthread_mutex_destroy(&arena->lock);
+	free(arena->pcp);
+	arena->pcp = NULL;
+	arena->n_pcp = 0;
+	arena->concurrent = 0;
+}
+
+/**
+ * Create a buddy arena over caller-provided memory
  *
- * @param size size in bytes
- * @return memory block address
+ * The arena and its page metadata are allocated on the heap; the region
+ * itself stays owned by the caller.
+ *
+ * @param base start of the memory region to manage
+ * @param size size of the region in bytes, must be a power of two
+ * @param min_order order of the smallest block (the page size)
+ * @return the new arena
+ * @return NULL if the arguments are invalid or out of memory
  */
-void *buddy_alloc(int size)
+buddy_arena_t *buddy_arena_create(void *base, size_t size, int min_order)
 {
-#if USE_DEBUG
-	printf("Attempting buddy_alloc with request size of %i bytes.\n", size);
-#endif
-	// Check if out of bounds
-	if(size > (1 << MAX_ORDER) || size <= 0) {
-	#if USE_DEBUG
-		printf("Error: Invalid allocation request: %i is not a valid request size\n", size);
-	#endif
+	int max_order = arena_max_order(base, size, min_order);
+	buddy_arena_t *arena;
+	page_t *pages;
+
+	if(max_order < 0)
 		return NULL;
-	}
 
-	// Determine what order is needed to allocate this memory
-	int size_order = MIN_ORDER, i;
+	arena = malloc(sizeof(buddy_arena_t));
+	pages = malloc((size >> min_order) * sizeof(page_t));
 
-	while(size_order <= MAX_ORDER && (1 << size_order) < size) {
-		size_order++;
+	if(arena == NULL || pages == NULL) {
+		free(arena);
+		free(pages);
+		return NULL;
 	}
 
+	arena_setup(arena, base, max_order, min_order, pages);
+	return arena;
+}
+
+/**
+ * Destroy an arena created by buddy_arena_create()
+ *
+ * The managed region is not touched; every block allocated from the arena
+ * becomes invalid.
+ *
+ * @param arena arena to destroy
+ */
+void buddy_arena_destroy(buddy_arena_t *arena)
+{
+	if(arena == NULL || arena == &default_arena)
+		return;
+
+	arena_teardown(arena);
+	free(arena->pages);
+	free(arena);
+}
+
+/**
+ * Take a free block of the given order off the free lists
+ *
+ * The smallest free block that is big enough is split down, handing the
+ * right half of every split back to free_area.
+ *
+ * @param arena arena to allocate from
+ * @param size_order order of the block wanted
+ * @param state state to leave the head page in, PAGE_IN_USE or PAGE_GUARDED
+ * @return head page of the block
+ * @return NULL if no block is big enough
+ */
+static page_t *arena_alloc_order(buddy_arena_t *arena, int size_order, int state)
+{
+	// The lowest set bit at or above size_order is the smallest free block
+	// big enough to hold this request
+	unsigned long candidates = arena->free_mask & ~((1UL << size_order) - 1);
+	int order;
+
+	// No blocks big enough to fulfill this request are available.
+	if(candidates == 0)
+		return NULL;
+
+	order = __builtin_ctzl(candidates);
+
 #if USE_DEBUG
-	printf("Requested size is %i, order of %i\n", size, size_order);
+	printf("Found free block of order %i, partitioning...\n", order);
 #endif
 
-	// Find the next available memory, if we are at a free block that's the correct
-	// order, we'll use that block. If not, we'll recursively break it down
-	for(i = size_order; i <= MAX_ORDER; i++) {
-
-		// If there's an available block, begin partitioning it
-		if(!list_empty(&free_area[i])) {
-
-		#if USE_DEBUG
-			printf("Found empty block of order %i, partitioning...\n", i);
-		#endif
-
-			page_t *left, *right;
-			int request_page_index;
-			void *request_page_addr;
-
-			// Break this block down until we have an appropriate size. Once 
-			// we've determined we have a block big enough, return it's address
-			// If we're at the smallest block to allocate the request, return the address
-			if(i == size_order) {
-			#if USE_DEBUG
-				printf("Block of order %i, has been partitioned, returning address...\n", i);
-			#endif
-				// Grab onto the left side of this list
-				left = list_entry(free_area[i].next, page_t, list);
-
-				// Delete this entry
-				list_del(&(left->list));
-			}
-			// Else, break the block down and appropriately add half to free_area
-			else {
-				// Recursively grab onto the most left page of the breakdown
-				#if USE_DEBUG
-					printf("Entering recursion...\n");
-				#endif
-				left = &g_pages[ADDR_TO_PAGE(buddy_alloc((1 << (size_order + 1))))];
-
-				// Calculate the block's index to the right of left
-				request_page_index = left->index + (1 << size_order) / PAGE_SIZE;
-				right = &g_pages[request_page_index];
-
-				// Add the right list to free area
-				list_add(&(right->list), &free_area[size_order]);
-			}
+	// Grab onto the left side of this list
+	page_t *left = &arena->pages[arena->free_area[order]];
+	free_area_del(arena, left);
+
+	// Break the block down until it is the right size
+	arena->stats.splits += order - size_order;
+	while(order > size_order) {
+		page_t *right = left + (1 << (order - 1 - arena->min_order));
 
-			// Recursion finished (At this step)...update left block properties
-			left->block_size_order = size_order;
+		order--;
+		right->decay_epoch = left->decay_epoch;
+		free_area_add(arena, right, order);
+	}
+
+	left->block_size_order = size_order;
+	left->state = state;
+	return left;
+}
+
+/**
+ * Return a block to the free lists, merging it with its buddies
+ *
+ * @param arena arena owning the block
+ * @param request_page_index index of the block's head page
+ * @param epoch decay epoch of the block: when it was last dirtied, or PURGED
+ * @return order of the free block it ends up in
+ */
+static int arena_free_block(buddy_arena_t *arena, int request_page_index, uint16_t epoch)
+{
+	int request_page_order = arena->pages[request_page_index].block_size_order;
 
-			// Calculate the requested page's address and return it
-			request_page_addr = PAGE_TO_ADDR(left->index);
-			return request_page_addr;
+	page_t *buddy;
+	int buddy_index;
+
+	// A guarded block loses its guard, even if it ends up merged away
+	arena->pages[request_page_index].state = PAGE_IN_USE;
+
+	// Keep merging with our buddy for as long as it is free at this order
+	for(; request_page_order < arena->max_order; request_page_order++) {
+		buddy_index = BUDDY_INDEX(arena, request_page_index, request_page_order);
+		buddy = &arena->pages[buddy_index];
+
+		// The buddy's head page tells us directly if it is free at this order
+		if((buddy->state != PAGE_FREE && buddy->state != BULK_PENDING)
+		   || buddy->block_size_order != request_page_order)
+			break;
+
+		// The merged block ages from its longest idle dirty part, so a small
+		// free next to a large idle block does not hold off its purge
+		if(buddy->decay_epoch != PURGED && (epoch == PURGED || EPOCH_BEFORE(buddy->decay_epoch, epoch)))
+			epoch = buddy->decay_epoch;
+
+		// Remove the buddy from free_area (it's been consumed)
+		arena->stats.merges++;
+		if(buddy->state == BULK_PENDING)
+			buddy->state = PAGE_IN_USE;
+		else
+			free_area_del(arena, buddy);
+
+		// The right half is no longer the head of a block
+		if(buddy_index > request_page_index) {
+			buddy->block_size_order = -1;
+		}
+		else {
+			arena->pages[request_page_index].block_size_order = -1;
+			request_page_index = buddy_index;
 		}
 	}
 
-	// No blocks big enough to fulfill this request are available.
-	return NULL;
+	arena->pages[request_page_index].decay_epoch = epoch;
+	free_area_add(arena, &arena->pages[request_page_index], request_page_order);
+
+	return request_page_order;
 }
 
 /**
- * Free an allocated memory block.
+ * Return a block freed just now to the free lists
  *
- * Whenever a block is freed, the allocator checks its buddy. If the buddy is
- * free as well, then the two buddies are combined to form a bigger block. This
- * process continues until one of the buddies is not free.
+ * @param arena arena owning the block
+ * @param request_page_index index of the block's head page
+ * @return order of the free block it ends up in
+ */
+static int arena_free_page(buddy_arena_t *arena, int request_page_index)
+{
+	return arena_free_block(arena, request_page_index, arena->epoch);
+}
+
+/**
+ * Give the pages of idle free blocks back to the OS
  *
- * @param addr memory block address to be freed
+ * The blocks stay free; their memory reads back as zeros once it is touched
+ * again. Blocks not aligned to an OS page are skipped. In concurrent mode the
+ * arena lock is not held across madvise(): each round takes up to PURGE_BATCH
+ * blocks off the free lists under the lock, purges them without it and puts
+ * them back. Allocations that need those blocks in the meantime fail.
+ *
+ * @param arena arena to purge
+ * @param min_order smallest order of block to purge
+ * @param min_age only purge blocks last dirtied at least this many epochs ago
+ * @return number of bytes released
  */
-void buddy_free(void *addr)
+static size_t arena_purge(buddy_arena_t *arena, int min_order, int min_age)
 {
-#if USE_DEBUG
-	printf("Attempting buddy_free with request address of %p\n", addr);
-#endif
-	// Store the page index & the order_size of the memory we want to free
-	int request_page_index = ADDR_TO_PAGE(addr),
-		request_page_order = g_pages[request_page_index].block_size_order;
-
-	page_t *temp;
-	struct list_head *current;
-
-	// Check this block size and all those larger than it
-	// @note - this only continues if we can continue merging buddies
-	for(;; request_page_order++) {
-		temp = NULL;
-
-		// Loop through the free_area array to check our buddy
-		list_for_each(current, &free_area[request_page_order]) {
-			// Get the entry from this page
-			temp = list_entry(current, page_t, list);
-
-			// If there's no free elements at this size
-			if(temp == NULL)
-				break;
-			// If we found our buddy as a free element
-			else if(temp->block_addr == BUDDY_ADDR(addr, request_page_order))
-				break;
-		}
-		
-		// temp is NULL (no free_area blocks of this size)
-		if(temp == NULL) {
-			g_pages[request_page_index].block_size_order = -1;
-			list_add(&g_pages[request_page_index].list, &free_area[request_page_order]);
-			return;
+	unsigned long os_page = sysconf(_SC_PAGESIZE);
+	uint32_t batch[PURGE_BATCH];
+	size_t released = 0, round;
+	uint32_t idx, next;
+	int n, i, o;
+
+	if(min_order < arena->min_order)
+		min_order = arena->min_order;
+
+	do {
+		n = 0;
+
+		if(arena->concurrent)
+			pthread_mutex_lock(&arena->lock);
+
+		for(o = min_order; o <= arena->max_order && n < PURGE_BATCH; o++) {
+			for(idx = arena->free_area[o]; idx != NIL && n < PURGE_BATCH; idx = next) {
+				page_t *page = &arena->pages[idx];
+				char *addr = PAGE_TO_ADDR(arena, idx);
+
+				next = page->next;
+
+				if(page->decay_epoch == PURGED || EPOCH_AGE(page->decay_epoch, arena->epoch) < min_age
+				   || ((unsigned long)addr & (os_page - 1)) != 0 || (1UL << o) < os_page)
+					continue;
+
+				// Off the free lists nobody can allocate or merge it
+				free_area_del(arena, page);
+				page->state = PAGE_PURGING;
+				batch[n++] = idx;
+			}
 		}
-		// temp size exists, but we couldn't find our buddy
-		else if(temp->block_addr != BUDDY_ADDR(addr, request_page_order)) {
-			g_pages[request_page_index].block_size_order = -1;
-			list_add(&g_pages[request_page_index].list, &free_area[request_page_order]);
-			return;
+
+		if(arena->concurrent)
+			pthread_mutex_unlock(&arena->lock);
+
+		for(i = 0, round = 0; i < n; i++) {
+			size_t bytes = 1UL << arena->pages[batch[i]].block_size_order;
+
+			madvise(PAGE_TO_ADDR(arena, batch[i]), bytes, MADV_DONTNEED);
+			round += bytes;
 		}
-		// If we're at this point, we found our buddy, so we need to put them together
 
-		// if the input address is larger than temp's address (right half), update it to smaller value
-		if((char*) addr > temp->block_addr) {
-			addr = temp->block_addr;
+		if(arena->concurrent)
+			pthread_mutex_lock(&arena->lock);
+
+		for(i = 0; i < n; i++)
+			arena_free_block(arena, batch[i], PURGED);
+		arena->stats.bytes_released += round;
+
+		if(arena->concurrent)
+			pthread_mutex_unlock(&arena->lock);
+
+		released += round;
+	} while(n == PURGE_BATCH);
+
+	return released;
+}
+
+/**
+ * Advance the decay clock and purge blocks idle for a whole period
+ *
+ * A block dirtied in epoch e is purged once epoch e + 1 has ended, so it has
+ * sat free for at least decay_ms. Takes the arena lock itself, so it must be
+ * called without it.
+ *
+ * @param arena arena to age
+ * @return number of bytes released
+ */
+static size_t arena_decay(buddy_arena_t *arena)
+{
+	struct timespec now;
+	int order = -1;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = now.tv_sec * 1000L + now.tv_nsec / 1000000;
+
+	if(arena->concurrent)
+		pthread_mutex_lock(&arena->lock);
+
+	if(arena->decay_order >= 0 && ms - arena->epoch_start >= arena->decay_ms) {
+		arena->epoch = (arena->epoch + 1) % EPOCHS;
+		arena->epoch_start = ms;
+		order = arena->decay_order;
+	}
+
+	if(arena->concurrent)
+		pthread_mutex_unlock(&arena->lock);
+
+	if(order < 0)
+		return 0;
+
+	return arena_purge(arena, order, arena->decay_ms == 0 ? 0 : 2);
+}
+
+/**
+ * Take up to n blocks of one order off the free lists
+ *
+ * Instead of splitting a large block once per allocation, each large block
+ * is carved into as many blocks of the wanted order as are still needed in
+ * one pass, and only the unused tail goes back to the free lists, as the
+ * fewest blocks possible.
+ *
+ * @param arena arena to allocate from
+ * @param order order of the blocks wanted
+ * @param n number of blocks wanted
+ * @param out receives the addresses of the blocks
+ * @return number of blocks allocated
+ */
+static int arena_alloc_bulk(buddy_arena_t *arena, int order, int n, void **out)
+{
+	int got = 0;
+
+	while(got < n) {
+		unsigned long candidates = arena->free_mask & ~((1UL << order) - 1);
+
+		if(candidates == 0)
+			break;
+
+		int block_order = __builtin_ctzl(candidates);
+		int first = arena->free_area[block_order];
+		page_t *block = &arena->pages[first];
+		int pieces = 1 << (block_order - order);
+		int step = 1 << (order - arena->min_order);
+		int take = pieces < n - got ? pieces : n - got;
+		int i;
 
-			// Update the page index to account for a change in address
-			request_page_index = ADDR_TO_PAGE(addr);
+		free_area_del(arena, block);
+
+		for(i = 0; i < take; i++) {
+			arena->pages[first + i * step].block_size_order = order;
+			out[got++] = PAGE_TO_ADDR(arena, first + i * step);
+		}
+
+		// Free the tail as maximal blocks; at piece i the largest aligned
+		// block that fits is given by the lowest set bit of i
+		for(i = take; i < pieces; i += i & -i) {
+			arena->pages[first + i * step].decay_epoch = block->decay_epoch;
+			free_area_add(arena, &arena->pages[first + i * step],
+						  order + __builtin_ctz(i));
+			arena->stats.splits++;
 		}
-		
-		// Remove this block from free_area (it's been consumed)
-		list_del(&(temp->list));
+
+		// Carving into take pieces splits take - 1 times more
+		arena->stats.splits += take - 1;
 	}
+
+	return got;
 }
 
 /**
- * Print the buddy system status---order oriented
+ * Resize an allocated block without moving it
  *
- * print free pages in each order.
+ * Shrinking splits the block and frees the right halves. Growing absorbs the
+ * right-hand buddy at every order up to new_order, which is only possible
+ * when the block is the left buddy at each of those orders and every one of
+ * those buddies is free and whole. Nothing changes if the block cannot grow.
+ *
+ * @param arena arena owning the block
+ * @param page_index index of the block's head page
+ * @param new_order order the block should have
+ * @return 1 if the block now has new_order
+ * @return 0 if it has to be moved instead
  */
-void buddy_dump()
+static int arena_resize(buddy_arena_t *arena, int page_index, int new_order)
 {
+	page_t *page = &arena->pages[page_index];
+	int order = page->block_size_order;
 	int o;
-	for (o = MIN_ORDER; o <= MAX_ORDER; o++) {
-		struct list_head *pos;
-		int cnt = 0;
-		list_for_each(pos, &free_area[o]) {
-			cnt++;
-		}
-		printf("%d:%dK ", cnt, (1<<o)/1024);
+
+	while(order > new_order) {
+		page_t *tail = &arena->pages[page_index + (1 << (order - 1 - arena->min_order))];
+
+		order--;
+		tail->decay_epoch = arena->epoch;
+		free_area_add(arena, tail, order);
+		arena->stats.splits++;
 	}
-	printf("\n");
-}
\ No newline at end of file
+
+	if(order == new_order) {
+		page->block_size_order = order;
+		return 1;
+	}
+
+	// Check every buddy before touching any of them
+	for(o = order; o < new_order; o++) {
+		page_t *buddy = &arena->pages[BUDDY_INDEX(arena, page_index, o)];
+
+		if(PAGE_INDEX(arena, buddy) < page_index || buddy->state != PAGE_FREE || buddy->block_size_order != o)
+			return 0;
+	}
+
+	for(o = order; o < new_order; o++) {
+		page_t *buddy = &arena->pages[BUDDY_INDEX(arena, page_index, o)];
+
+		free_area_del(arena, buddy);
+		buddy->block_size_order = -1;
+		arena->stats.merges++;
+	}
+
+	page->block_size_order = new_order;
+	return 1;
+}
+
+#if USE_CHECKED
+/**
+ * Report heap corruption and abort
+ *
+ * @param addr address being freed
+ * @param msg what went wrong
+ */
+static void check_fail(void *addr, const char *msg)
+{
+	fprintf(stderr, "buddy: %s (%p)\n", msg, addr);
+	abort();
+}
+
+/**
+ * Pick the order of a guarded allocation
+ *
+ * A request that fills (or nearly fills) its block gets the next larger one,
+ * so that the canary trailer always fits. Only a request for the whole arena
+ * goes unguarded.
+ *
+ * @param arena arena the block comes from
+ * @param order smallest order holding the request
+ * @param size bytes asked for
+ * @return order of the block to hand out
+ */
+static inline int guard_order(buddy_arena_t *arena, int order, size_t size)
+{
+	return (1UL << order) - size < sizeof(guard_t) && order < arena->max_order ? order + 1 : order;
+}
+
+/**
+ * Decide whether an allocation has room for a canary trailer
+ *
+ * @param order order of the block
+ * @param size bytes asked for
+ * @return PAGE_GUARDED if the trailer fits in the slack, else PAGE_IN_USE
+ */
+static inline int guard_state(int order, size_t size)
+{
+	return (1UL << order) - size >= sizeof(guard_t) ? PAGE_GUARDED : PAGE_IN_USE;
+}
+
+/**
+ * Write the red zone and canary trailer of a guarded block
+ *
+ * @param addr start of the block
+ * @param order order of the block
+ * @param size bytes asked for
+ */
+static void guard_write(void *addr, int order, size_t size)
+{
+	char *trailer = (char *)addr + (1UL << order) - sizeof(guard_t);
+	size_t redzone = trailer - ((char *)addr + size);
+	guard_t guard = { size, CANARY ^ (unsigned long)addr };
+
+	memset((char *)addr + size, REDZONE_BYTE, redzone < REDZONE_SIZE ? redzone : REDZONE_SIZE);
+	memcpy(trailer, &guard, sizeof(guard));
+}
+
+/**
+ * Make sure an address is an allocated block of the arena with its guard intact
+ *
+ * @param arena arena the block should belong to
+ * @param addr address passed in by the caller
+ */
+static void check_block(buddy_arena_t *arena, void *addr)
+{
+	unsigned long offset = (char *)addr - arena->memory;
+	page_t *page;
+	int order;
+
+	if((char *)addr < arena->memory || offset >= (1UL << arena->max_order)
+	   || (offset & (PAGE_SIZE(arena) - 1)) != 0)
+		check_fail(addr, "invalid free: not a page of this arena");
+
+	page = &arena->pages[offset >> arena->min_order];
+	order = page->block_size_order;
+
+	if(page->state == PAGE_FREE || page->state == BULK_PENDING || page->state == PAGE_PURGING)
+		check_fail(addr, "double free");
+
+	if(order < arena->min_order || (offset & ((1UL << order) - 1)) != 0)
+		check_fail(addr, "invalid or double free: not the start of a block");
+
+	if(page->state == PAGE_GUARDED) {
+		char *trailer = (char *)addr + (1UL << order) - sizeof(guard_t);
+		guard_t guard;
+		size_t i;
+
+		memcpy(&guard, trailer, sizeof(guard));
+
+		if(guard.canary != (CANARY ^ (unsigned long)addr) || guard.size > (size_t)(trailer - (char *)addr))
+			check_fail(addr, "canary overwritten: write past the end of the block");
+
+		for(i = guard.size; i < guard.size + REDZONE_SIZE && (char *)addr + i < trailer; i++)
+			if(((unsigned char *)addr)[i] != REDZONE_BYTE)
+				check_fail(addr, "red zone overwritten: write past the end of the block");
+	}
+}
+
+/**
+ * Check a block about to be freed and poison its contents
+ *
+ * @param arena arena the block should belong to
+ * @param addr address passed in by the caller
+ */
+static void check_free(buddy_arena_t *arena, void *addr)
+{
+	check_block(arena, addr);
+	memset(addr, POISON_FREE, 1UL << arena->pages[ADDR_TO_PAGE(arena, addr)].block_size_order);
+}
+#endif
+
+/**
+ * Add to a counter, atomically if the arena is shared between threads
+ *
+ * @param arena arena owning the counter
+ * @param counter counter to update
+ * @param delta amount to add (may wrap to subtract)
+ * @return new value of the counter
+ */
+static inline unsigned long stat_add(buddy_arena_t *arena, unsigned long *counter,
+									 unsigned long delta)
+{
+	if(arena->concurrent)
+		return __atomic_add_fetch(counter, delta, __ATOMIC_RELAXED);
+
+	return *counter += delta;
+}
+
+/**
+ * Grow or shrink the bytes in use and raise the high-water mark
+ *
+ * @param arena arena the bytes belong to
+ * @param delta bytes added (may wrap to subtract)
+ */
+static void account_resize(buddy_arena_t *arena, unsigned long delta)
+{
+	counters_t *c = &arena->stats;
+	unsigned long in_use = stat_add(arena, &c->bytes_in_use, delta);
+	unsigned long high;
+
+	if(!arena->concurrent) {
+		if(in_use > c->high_water)
+			c->high_water = in_use;
+		return;
+	}
+
+	high = __atomic_load_n(&c->high_water, __ATOMIC_RELAXED);
+	while(in_use > high && !__atomic_compare_exchange_n(&c->high_water, &high, in_use, 1,
+														__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/**
+ * Record successful allocations and raise the high-water mark
+ *
+ * @param arena arena allocated from
+ * @param count number of blocks allocated
+ * @param requested bytes asked for
+ * @param granted bytes handed out
+ */
+static void account_alloc(buddy_arena_t *arena, unsigned long count, unsigned long requested,
+						  unsigned long granted)
+{
+	counters_t *c = &arena->stats;
+
+	stat_add(arena, &c->allocs, count);
+	stat_add(arena, &c->bytes_requested, requested);
+	stat_add(arena, &c->bytes_granted, granted);
+	account_resize(arena, granted);
+}
+
+/**
+ * Pick the per-CPU cache of the calling thread
+ */
+static inline pcp_t *arena_pcp(buddy_arena_t *arena)
+{
+	int cpu = sched_getcpu();
+
+	return &arena->pcp[cpu > 0 ? cpu % arena->n_pcp : 0];
+}
+
+/**
+ * Allocate a single page through the per-CPU cache
+ *
+ * An empty cache is refilled with PCP_BATCH pages under one acquisition of
+ * the arena lock.
+ *
+ * @param arena arena to allocate from
+ * @return head page of the block
+ * @return NULL if the arena is out of memory
+ */
+static page_t *pcp_alloc(buddy_arena_t *arena)
+{
+	pcp_t *pcp = arena_pcp(arena);
+	page_t *page = NULL;
+
+	pthread_mutex_lock(&pcp->lock);
+
+	if(pcp->count == 0) {
+		pthread_mutex_lock(&arena->lock);
+		while(pcp->count < PCP_BATCH && (page = arena_alloc_order(arena, arena->min_order, PAGE_IN_USE)) != NULL)
+			pcp->pages[pcp->count++] = PAGE_INDEX(arena, page);
+		pthread_mutex_unlock(&arena->lock);
+	}
+
+	if(pcp->count > 0)
+		page = &arena->pages[pcp->pages[--pcp->count]];
+
+	pthread_mutex_unlock(&pcp->lock);
+	return page;
+}
+
+/**
+ * Free a single page through the per-CPU cache
+ *
+ * A full cache hands its PCP_BATCH coldest pages back to the free lists
+ * under one acquisition of the arena lock.
+ *
+ * @param arena arena owning the page
+ * @param page_index index of the page
+ * @return largest order of free block the handed back pages ended up in
+ * @return -1 if the page stayed in the cache
+ */
+static int pcp_free(buddy_arena_t *arena, int page_index)
+{
+	pcp_t *pcp = arena_pcp(arena);
+	int merged = -1, i, o;
+
+	pthread_mutex_lock(&pcp->lock);
+
+	if(pcp->count == PCP_HIGH) {
+		pthread_mutex_lock(&arena->lock);
+		for(i = 0; i < PCP_BATCH; i++) {
+			o = arena_free_page(arena, pcp->pages[i]);
+			if(o > merged)
+				merged = o;
+		}
+		pthread_mutex_unlock(&arena->lock);
+
+		pcp->count -= PCP_BATCH;
+		memmove(pcp->pages, pcp->pages + PCP_BATCH, pcp->count * sizeof(int));
+	}
+
+	pcp->pages[pcp->count++] = page_index;
+
+	pthread_mutex_unlock(&pcp->lock);
+	return merged;
+}
+
+/**
+ * Make an arena safe to use from several threads at once
+ *
+ * The free lists are guarded by a single arena lock. With n_caches greater
+ * than zero, single-page allocations and frees go through that many per-CPU
+ * page caches and only touch the free lists in batches. Must be called before
+ * the arena is shared between threads, and at most once.
+ *
+ * @param arena arena to switch to concurrent mode
+ * @param n_caches number of per-CPU page caches, usually the CPU count
+ * @return 0 on success
+ * @return -1 if the caches cannot be allocated
+ */
+int buddy_arena_set_concurrent(buddy_arena_t *arena, int n_caches)
+{
+	int i;
+
+	if(arena->concurrent || n_caches < 0)
+		return -1;
+
+#if USE_CHECKED
+	// Every free must be checked against the page state under the arena lock
+	n_caches = 0;
+#endif
+
+	if(n_caches > 0) {
+		if(posix_memalign((void **)&arena->pcp, __alignof__(pcp_t), n_caches * sizeof(pcp_t)) != 0) {
+			arena->pcp = NULL;
+			return -1;
+		}
+
+		for(i = 0; i < n_caches; i++) {
+			pthread_mutex_init(&arena->pcp[i].lock, NULL);
+			arena->pcp[i].count = 0;
+		}
+	}
+
+	pthread_mutex_init(&arena->lock, NULL);
+	arena->n_pcp = n_caches;
+	arena->concurrent = 1;
+	return 0;
+}
+
+/**
+ * Hand every page held by the per-CPU caches back to the free lists
+ *
+ * Useful before buddy_arena_dump() so that cached pages show up as free.
+ *
+ * @param arena arena to drain
+ */
+void buddy_arena_drain(buddy_arena_t *arena)
+{
+	int i;
+
+	if(!arena->concurrent)
+		return;
+
+	for(i = 0; i < arena->n_pcp; i++) {
+		pcp_t *pcp = &arena->pcp[i];
+
+		pthread_mutex_lock(&pcp->lock);
+		pthread_mutex_lock(&arena->lock);
+		while(pcp->count > 0)
+			arena_free_page(arena, pcp->pages[--pcp->count]);
+		pthread_mutex_unlock(&arena->lock);
+		pthread_mutex_unlock(&pcp->lock);
+	}
+}
+
+/**
+ * Return the pages of idle free blocks to the OS automatically
+ *
+ * Whenever a block of at least the given order is allocated or freed, free
+ * blocks of that order or larger that have been idle for decay_ms or longer
+ * are purged with madvise(MADV_DONTNEED). They stay free and are reused as
+ * usual, at the cost of page faults on first touch. A decay_ms of 0 purges
+ * such blocks as soon as they are freed. An arena that sees no such traffic
+ * does not decay on its own; call buddy_arena_decay() from a timer to cover
+ * idle stretches, or buddy_arena_trim() to release everything at once.
+ *
+ * @param arena arena to configure
+ * @param order smallest order of block to purge, or -1 to turn decay off
+ * @param decay_ms how long a block must sit free before it is purged
+ * @return 0 on success
+ * @return -1 if the arguments are invalid
+ */
+int buddy_arena_set_decay(buddy_arena_t *arena, int order, long decay_ms)
+{
+	struct timespec now;
+
+	if(order > arena->max_order || decay_ms < 0)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if(arena->concurrent)
+		pthread_mutex_lock(&arena->lock);
+
+	arena->decay_order = order < 0 ? -1 : order;
+	arena->decay_ms = decay_ms;
+	arena->epoch_start = now.tv_sec * 1000L + now.tv_nsec / 1000000;
+
+	if(arena->concurrent)
+		pthread_mutex_unlock(&arena->lock);
+
+	return 0;
+}
+
+/**
+ * Return the pages of every free block to the OS now
+ *
+ * Pages held by per-CPU caches are not touched; call buddy_arena_drain()
+ * first to include them.
+ *
+ * @param arena arena to trim
+ * @return number of bytes released
+ */
+size_t buddy_arena_trim(buddy_arena_t *arena)
+{
+	return arena_purge(arena, arena->min_order, 0);
+}
+
+/**
+ * Run the decay clock without allocating or freeing
+ *
+ * Meant to be called periodically, e.g. every decay_ms, so that an arena that
+ * has gone idle still returns its idle free blocks. Does nothing unless decay
+ * is enabled with buddy_arena_set_decay().
+ *
+ * @param arena arena to age
+ * @return number of bytes released
+ */
+size_t buddy_arena_decay(buddy_arena_t *arena)
+{
+	return arena_decay(arena);
+}
+
+/**
+ * Allocate a memory block.
+ *
+ * On a memory request, the allocator returns the head of a free-list of the
+ * matching size (i.e., smallest block that satisfies the request). If the
+ * free-list of the matching block size is empty, then a larger block size will
+ * be selected. The selected (large) block is then splitted into two smaller
+ * blocks. Among the two blocks, left block will be used for allocation or be
+ * further splitted while the right block will be added to the appropriate
+ * free-list.
+ *
+ * @param arena arena to allocate from
+ * @param size size in bytes
+ * @return memory block address
+ */
+void *buddy_arena_alloc(buddy_arena_t *arena, size_t size)
+{
+#if USE_DEBUG
+	printf("Attempting buddy_alloc with request size of %zu bytes.\n", size);
+#endif
+	// Check if out of bounds
+	if(size == 0 || size > (1UL << arena->max_order)) {
+	#if USE_DEBUG
+		printf("Error: Invalid allocation request: %zu is not a valid request size\n", size);
+	#endif
+		stat_add(arena, &arena->stats.failed, 1);
+		return NULL;
+	}
+
+	// Determine what order is needed to allocate this memory
+	int size_order = size > PAGE_SIZE(arena) ? ORDER_OF(size) : arena->min_order;
+
+#if USE_DEBUG
+	printf("Requested size is %zu, order of %i\n", size, size_order);
+#endif
+
+#if USE_CHECKED
+	size_order = guard_order(arena, size_order, size);
+	int state = guard_state(size_order, size);
+#else
+	int state = PAGE_IN_USE;
+#endif
+	page_t *left;
+
+	if(!arena->concurrent) {
+		left = arena_alloc_order(arena, size_order, state);
+	}
+	else if(size_order == arena->min_order && arena->n_pcp > 0) {
+		left = pcp_alloc(arena);
+	}
+	else {
+		pthread_mutex_lock(&arena->lock);
+		left = arena_alloc_order(arena, size_order, state);
+		pthread_mutex_unlock(&arena->lock);
+	}
+
+	// Large allocations run the decay clock too, so an arena that has
+	// stopped freeing still returns what sits idle. The per-CPU cache path
+	// stays clear of the arena lock.
+	if(DECAY_DUE(arena, size_order) && !(arena->concurrent && size_order == arena->min_order && arena->n_pcp > 0))
+		arena_decay(arena);
+
+	if(left == NULL) {
+		stat_add(arena, &arena->stats.failed, 1);
+		return NULL;
+	}
+
+	account_alloc(arena, 1, size, 1UL << size_order);
+
+	// Calculate the requested page's address and return it
+	void *addr = PAGE_TO_ADDR(arena, PAGE_INDEX(arena, left));
+
+#if USE_CHECKED
+	if(state == PAGE_GUARDED)
+		guard_write(addr, size_order, size);
+#endif
+
+	return addr;
+}
+
+/**
+ * Free an allocated memory block.
+ *
+ * Whenever a block is freed, the allocator checks its buddy. If the buddy is
+ * free as well, then the two buddies are combined to form a bigger block. This
+ * process continues until one of the buddies is not free.
+ *
+ * @param arena arena the block was allocated from
+ * @param addr memory block address to be freed
+ */
+void buddy_arena_free(buddy_arena_t *arena, void *addr)
+{
+#if USE_DEBUG
+	printf("Attempting buddy_free with request address of %p\n", addr);
+#endif
+	int request_page_index = ADDR_TO_PAGE(arena, addr);
+	int order, merged;
+
+	// Checked builds have no per-CPU caches, so every free is checked under
+	// the arena lock and cannot race another free of the same block
+	if(!arena->concurrent) {
+#if USE_CHECKED
+		check_free(arena, addr);
+#endif
+		order = arena->pages[request_page_index].block_size_order;
+		merged = arena_free_page(arena, request_page_index);
+	}
+	else if(arena->n_pcp > 0
+			&& arena->pages[request_page_index].block_size_order == arena->min_order) {
+		order = arena->min_order;
+		merged = pcp_free(arena, request_page_index);
+	}
+	else {
+		pthread_mutex_lock(&arena->lock);
+#if USE_CHECKED
+		check_free(arena, addr);
+#endif
+		order = arena->pages[request_page_index].block_size_order;
+		merged = arena_free_page(arena, request_page_index);
+		pthread_mutex_unlock(&arena->lock);
+	}
+
+	stat_add(arena, &arena->stats.frees, 1);
+	stat_add(arena, &arena->stats.bytes_in_use, -(1UL << order));
+
+	// Purging happens outside the arena lock
+	if(DECAY_DUE(arena, merged))
+		arena_decay(arena);
+}
+
+/**
+ * Allocate a memory block aligned beyond its natural order
+ *
+ * Blocks are aligned to their own size relative to the start of the arena.
+ * A block of the alignment's order is taken and its tail is handed back
+ * right away, so the result costs no more memory than buddy_arena_alloc().
+ *
+ * @param arena arena to allocate from, whose start must be aligned to align
+ * @param size size in bytes
+ * @param align alignment in bytes, a power of two
+ * @return memory block address, a multiple of align
+ * @return NULL if out of memory or the alignment cannot be met
+ */
+void *buddy_arena_alloc_aligned(buddy_arena_t *arena, size_t size, size_t align)
+{
+	if(align == 0 || (align & (align - 1)) != 0 || ((unsigned long)arena->memory & (align - 1)) != 0
+	   || size == 0 || size > (1UL << arena->max_order) || align > (1UL << arena->max_order)) {
+		stat_add(arena, &arena->stats.failed, 1);
+		return NULL;
+	}
+
+	int size_order = size > PAGE_SIZE(arena) ? ORDER_OF(size) : arena->min_order;
+	int align_order = __builtin_ctzl(align);
+	page_t *left;
+
+#if USE_CHECKED
+	size_order = guard_order(arena, size_order, size);
+#endif
+
+	// Every block is already aligned to its size
+	if(align_order <= size_order)
+		return buddy_arena_alloc(arena, size);
+
+#if USE_CHECKED
+	int state = guard_state(size_order, size);
+#else
+	int state = PAGE_IN_USE;
+#endif
+
+	if(arena->concurrent)
+		pthread_mutex_lock(&arena->lock);
+
+	left = arena_alloc_order(arena, align_order, state);
+	if(left != NULL)
+		arena_resize(arena, PAGE_INDEX(arena, left), size_order);
+
+	if(arena->concurrent)
+		pthread_mutex_unlock(&arena->lock);
+
+	if(left == NULL) {
+		stat_add(arena, &arena->stats.failed, 1);
+		return NULL;
+	}
+
+	account_alloc(arena, 1, size, 1UL << size_order);
+
+	void *addr = PAGE_TO_ADDR(arena, PAGE_INDEX(arena, left));
+
+#if USE_CHECKED
+	if(state == PAGE_GUARDED)
+		guard_write(addr, size_order, size);
+#endif
+
+	return addr;
+}
+
+/**
+ * Change the size of an allocated block
+ *
+ * The block is resized in place whenever possible: shrinking frees the tail
+ * halves, and growing absorbs free right-hand buddies. Only when a buddy in
+ * the way is in use is a new block allocated, the contents copied and the
+ * old block freed. As with realloc(), a NULL addr allocates and a size of 0
+ * frees.
+ *
+ * @param arena arena the block was allocated from
+ * @param addr memory block address, or NULL
+ * @param size new size in bytes
+ * @return address of the resized block, which may differ from addr
+ * @return NULL if out of memory, in which case addr is left untouched
+ */
+void *buddy_arena_realloc(buddy_arena_t *arena, void *addr, size_t size)
+{
+	if(addr == NULL)
+		return buddy_arena_alloc(arena, size);
+
+	if(size == 0) {
+		buddy_arena_free(arena, addr);
+		return NULL;
+	}
+
+	if(size > (1UL << arena->max_order)) {
+		stat_add(arena, &arena->stats.failed, 1);
+		return NULL;
+	}
+
+	int page_index = ADDR_TO_PAGE(arena, addr);
+	int new_order = size > PAGE_SIZE(arena) ? ORDER_OF(size) : arena->min_order;
+	int old_order, resized;
+
+#if USE_CHECKED
+	new_order = guard_order(arena, new_order, size);
+#else
+	old_order = arena->pages[page_index].block_size_order;
+	if(new_order == old_order)
+		return addr;
+#endif
+
+	if(arena->concurrent)
+		pthread_mutex_lock(&arena->lock);
+
+#if USE_CHECKED
+	// Checked under the lock, like a free. Even within the same block the
+	// guard has to move to the new size.
+	check_block(arena, addr);
+	old_order = arena->pages[page_index].block_size_order;
+#endif
+
+	resized = arena_resize(arena, page_index, new_order);
+
+#if USE_CHECKED
+	if(resized) {
+		arena->pages[page_index].state = guard_state(new_order, size);
+		if(arena->pages[page_index].state == PAGE_GUARDED)
+			guard_write(addr, new_order, size);
+	}
+#endif
+
+	if(arena->concurrent)
+		pthread_mutex_unlock(&arena->lock);
+
+	if(resized) {
+		account_resize(arena, (1UL << new_order) - (1UL << old_order));
+		return addr;
+	}
+
+	void *moved = buddy_arena_alloc(arena, size);
+
+	if(moved == NULL)
+		return NULL;
+
+	// Copy no more than the caller asked for, so that a checked build's red
+	// zone at moved + size is left intact
+	memcpy(moved, addr, size < (1UL << old_order) ? size : 1UL << old_order);
+	buddy_arena_free(arena, addr);
+	return moved;
+}
+
+/**
+ * Allocate several blocks of the same order in one call
+ *
+ * The arena lock is taken once for the whole batch and large blocks are
+ * split once per batch rather than once per block.
+ *
+ * @param arena arena to allocate from
+ * @param order order of every block (log2 of its size in bytes)
+ * @param n number of blocks wanted
+ * @param out receives the addresses of the blocks, must hold n entries
+ * @return number of blocks allocated, less than n if the arena ran out
+ */
+int buddy_arena_alloc_bulk(buddy_arena_t *arena, int order, int n, void **out)
+{
+	int got;
+
+	if(n <= 0 || order > arena->max_order)
+		return 0;
+
+	if(order < arena->min_order)
+		order = arena->min_order;
+
+	if(!arena->concurrent) {
+		got = arena_alloc_bulk(arena, order, n, out);
+	}
+	else {
+		pthread_mutex_lock(&arena->lock);
+		got = arena_alloc_bulk(arena, order, n, out);
+		pthread_mutex_unlock(&arena->lock);
+	}
+
+	account_alloc(arena, got, (unsigned long)got << order, (unsigned long)got << order);
+	stat_add(arena, &arena->stats.failed, n - got);
+
+	return got;
+}
+
+/**
+ * Free several blocks in one call
+ *
+ * Every block is first marked free without touching the free lists, and
+ * coalescing runs once at the end of the batch. Blocks of the batch that
+ * merge with each other never enter a free list at all.
+ *
+ * @param arena arena the blocks were allocated from
+ * @param ptrs addresses of the blocks to free
+ * @param n number of blocks
+ */
+void buddy_arena_free_bulk(buddy_arena_t *arena, void **ptrs, int n)
+{
+	int merged = -1, i, o, page_index;
+
+	if(arena->concurrent)
+		pthread_mutex_lock(&arena->lock);
+
+	for(i = 0; i < n; i++) {
+		page_t *page = &arena->pages[ADDR_TO_PAGE(arena, ptrs[i])];
+
+#if USE_CHECKED
+		check_free(arena, ptrs[i]);
+#endif
+
+		page->state = BULK_PENDING;
+		page->decay_epoch = arena->epoch;
+		stat_add(arena, &arena->stats.bytes_in_use, -(1UL << page->block_size_order));
+	}
+	stat_add(arena, &arena->stats.frees, n);
+
+	// Blocks already absorbed by a buddy earlier in the batch are skipped
+	for(i = 0; i < n; i++) {
+		page_index = ADDR_TO_PAGE(arena, ptrs[i]);
+
+		if(arena->pages[page_index].state == BULK_PENDING) {
+			arena->pages[page_index].state = PAGE_IN_USE;
+			o = arena_free_page(arena, page_index);
+			if(o > merged)
+				merged = o;
+		}
+	}
+
+	if(arena->concurrent)
+		pthread_mutex_unlock(&arena->lock);
+
+	if(DECAY_DUE(arena, merged))
+		arena_decay(arena);
+}
+
+/**
+ * Print the buddy system status---order oriented
+ *
+ * print free pages in each order.
+ *
+ * @param arena arena to print
+ */
+void buddy_arena_dump(buddy_arena_t *arena)
+{
+	int o;
+	for (o = arena->min_order; o <= arena->max_order; o++) {
+		printf("%lu:%luK ", arena->nr_free[o], (1UL<<o)/1024);
+	}
+	printf("\n");
+}
+
+/**
+ * Take a snapshot of the statistics of an arena
+ *
+ * The external fragmentation index of order o is the share of free bytes
+ * held in blocks smaller than 1 << o, i.e. free memory that cannot serve a
+ * request of that order. 0 means all free memory is usable, values close to
+ * 1 mean a request of that order is likely to fail despite free memory.
+ *
+ * Pages held by per-CPU caches count neither as in use nor as free.
+ *
+ * @param arena arena to query
+ * @param stats receives the statistics
+ */
+void buddy_arena_stats(buddy_arena_t *arena, buddy_stats_t *stats)
+{
+	counters_t *c = &arena->stats;
+	unsigned long usable = 0;
+	int o;
+
+	memset(stats, 0, sizeof(*stats));
+
+	if(arena->concurrent)
+		pthread_mutex_lock(&arena->lock);
+
+	stats->min_order = arena->min_order;
+	stats->max_order = arena->max_order;
+
+	for(o = arena->min_order; o <= arena->max_order; o++)
+		stats->bytes_free += arena->nr_free[o] << o;
+
+	// Walk down from the largest order, accumulating usable free bytes
+	for(o = arena->max_order; o >= arena->min_order; o--) {
+		usable += arena->nr_free[o] << o;
+		stats->ext_frag[o] = stats->bytes_free ? 1.0 - (double)usable / stats->bytes_free : 0.0;
+	}
+
+	stats->splits = c->splits;
+	stats->merges = c->merges;
+	stats->bytes_released = c->bytes_released;
+
+	if(arena->concurrent)
+		pthread_mutex_unlock(&arena->lock);
+
+	stats->bytes_in_use = __atomic_load_n(&c->bytes_in_use, __ATOMIC_RELAXED);
+	stats->high_water = __atomic_load_n(&c->high_water, __ATOMIC_RELAXED);
+	stats->bytes_requested = __atomic_load_n(&c->bytes_requested, __ATOMIC_RELAXED);
+	stats->bytes_granted = __atomic_load_n(&c->bytes_granted, __ATOMIC_RELAXED);
+	stats->allocs = __atomic_load_n(&c->allocs, __ATOMIC_RELAXED);
+	stats->frees = __atomic_load_n(&c->frees, __ATOMIC_RELAXED);
+	stats->failed = __atomic_load_n(&c->failed, __ATOMIC_RELAXED);
+
+	stats->internal_frag = stats->bytes_granted
+		? 1.0 - (double)stats->bytes_requested / stats->bytes_granted : 0.0;
+}
+
+/**
+ * Return the size of the smallest block of an arena
+ *
+ * @param arena arena to query
+ */
+size_t buddy_arena_page_size(buddy_arena_t *arena)
+{
+	return PAGE_SIZE(arena);
+}
+
+/**
+ * Find the start of the block of a given order that contains an address
+ *
+ * Blocks are aligned to their size relative to the start of the arena, so
+ * this works for any address inside an allocated block.
+ *
+ * @param arena arena owning the address
+ * @param addr address inside the block
+ * @param order order of the block
+ * @return start address of the block
+ */
+void *buddy_arena_block_start(buddy_arena_t *arena, void *addr, int order)
+{
+	unsigned long offset = (char *)addr - arena->memory;
+
+	return arena->memory + (offset & ~((1UL << order) - 1));
+}
+
+/**
+ * Map a region of memory to back an arena
+ *
+ * The region is aligned to its own size (and to a huge page), so every block
+ * of an arena over it is aligned to its size in absolute terms, which is
+ * what buddy_arena_alloc_aligned() needs. Pages are only committed when
+ * touched. With BUDDY_MAP_HUGEPAGE the region is marked for transparent huge
+ * pages to cut TLB misses; if the kernel has them disabled the region still
+ * works with normal pages.
+ *
+ * @param size size of the region in bytes, a power of two
+ * @param flags 0 or BUDDY_MAP_HUGEPAGE
+ * @return start of the region
+ * @return NULL if the region cannot be mapped
+ */
+void *buddy_map_region(size_t size, int flags)
+{
+	size_t align = size > HUGE_PAGE_SIZE ? size : HUGE_PAGE_SIZE;
+	char *raw, *base;
+
+	if(size == 0 || (size & (size - 1)) != 0 || size + align < size)
+		return NULL;
+
+	// Over-map by the alignment, then cut off both ends
+	raw = mmap(NULL, size + align, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(raw == MAP_FAILED)
+		return NULL;
+
+	base = (char *)(((unsigned long)raw + align - 1) & ~(align - 1));
+
+	if(base > raw)
+		munmap(raw, base - raw);
+	munmap(base + size, raw + align - base);
+
+#ifdef MADV_HUGEPAGE
+	if(flags & BUDDY_MAP_HUGEPAGE)
+		madvise(base, size, MADV_HUGEPAGE);
+#endif
+
+	return base;
+}
+
+/**
+ * Unmap a region returned by buddy_map_region()
+ *
+ * @param base start of the region
+ * @param size size of the region in bytes
+ */
+void buddy_unmap_region(void *base, size_t size)
+{
+	munmap(base, size);
+}
+
+/**
+ * Return the arena used by the buddy_init() family of functions
+ */
+buddy_arena_t *buddy_default_arena()
+{
+	return &default_arena;
+}
+
+/**
+ * Initialize the default arena over caller-provided memory
+ *
+ * The whole region becomes a single free block. Page metadata is sized to the
+ * region and allocated on the heap, so any power-of-two arena can be managed
+ * (e.g. an mmap'd 1 GiB region). Calling this again discards the previous
+ * arena.
+ *
+ * @param base start of the memory region to manage
+ * @param size size of the region in bytes, must be a power of two
+ * @param min_order order of the smallest block (the page size)
+ * @return 0 on success
+ * @return -1 if the arguments are invalid or the metadata cannot be allocated
+ */
+int buddy_init_ex(void *base, size_t size, int min_order)
+{
+	int max_order = arena_max_order(base, size, min_order);
+	page_t *pages;
+
+	if(max_order < 0)
+		return -1;
+
+	if(base == default_memory && size == sizeof(default_memory) && min_order == MIN_ORDER) {
+		pages = default_pages;
+	}
+	else {
+		pages = malloc((size >> min_order) * sizeof(page_t));
+
+		if(pages == NULL)
+			return -1;
+	}
+
+	arena_teardown(&default_arena);
+
+	if(default_arena.pages != NULL && default_arena.pages != default_pages)
+		free(default_arena.pages);
+
+	arena_setup(&default_arena, base, max_order, min_order, pages);
+	return 0;
+}
+
+/**
+ * Initialize the buddy system
+ */
+void buddy_init()
+{
+	buddy_init_ex(default_memory, sizeof(default_memory), MIN_ORDER);
+}
+
+/**
+ * Allocate a memory block from the default arena
+ *
+ * @param size size in bytes
+ * @return memory block address
+ */
+void *buddy_alloc(int size)
+{
+	if(size <= 0)
+		return NULL;
+
+	return buddy_arena_alloc(&default_arena, size);
+}
+
+/**
+ * Free a memory block of the default arena
+ *
+ * @param addr memory block address to be freed
+ */
+void buddy_free(void *addr)
+{
+	buddy_arena_free(&default_arena, addr);
+}
+
+/**
+ * Allocate an aligned memory block from the default arena
+ *
+ * @param size size in bytes
+ * @param align alignment in bytes, a power of two
+ * @return memory block address
+ */
+void *buddy_alloc_aligned(int size, size_t align)
+{
+	if(size <= 0)
+		return NULL;
+
+	return buddy_arena_alloc_aligned(&default_arena, size, align);
+}
+
+/**
+ * Change the size of a memory block of the default arena
+ *
+ * @param addr memory block address, or NULL
+ * @param size new size in bytes
+ * @return address of the resized block
+ */
+void *buddy_realloc(void *addr, int size)
+{
+	if(size < 0)
+		return NULL;
+
+	return buddy_arena_realloc(&default_arena, addr, size);
+}
+
+/**
+ * Allocate several blocks of the same order from the default arena
+ *
+ * @param order order of every block (log2 of its size in bytes)
+ * @param n number of blocks wanted
+ * @param out receives the addresses of the blocks, must hold n entries
+ * @return number of blocks allocated
+ */
+int buddy_alloc_bulk(int order, int n, void **out)
+{
+	return buddy_arena_alloc_bulk(&default_arena, order, n, out);
+}
+
+/**
+ * Free several blocks of the default arena
+ *
+ * @param ptrs addresses of the blocks to free
+ * @param n number of blocks
+ */
+void buddy_free_bulk(void **ptrs, int n)
+{
+	buddy_arena_free_bulk(&default_arena, ptrs, n);
+}
+
+/**
+ * Configure automatic purging of idle free blocks of the default arena
+ *
+ * @param order smallest order of block to purge, or -1 to turn decay off
+ * @param decay_ms how long a block must sit free before it is purged
+ * @return 0 on success
+ */
+int buddy_set_decay(int order, long decay_ms)
+{
+	return buddy_arena_set_decay(&default_arena, order, decay_ms);
+}
+
+/**
+ * Return the pages of every free block of the default arena to the OS
+ *
+ * @return number of bytes released
+ */
+size_t buddy_trim()
+{
+	return buddy_arena_trim(&default_arena);
+}
+
+/**
+ * Run the decay clock of the default arena without allocating or freeing
+ *
+ * @return number of bytes released
+ */
+size_t buddy_decay()
+{
+	return buddy_arena_decay(&default_arena);
+}
+
+/**
+ * Take a snapshot of the statistics of the default arena
+ *
+ * @param stats receives the statistics
+ */
+void buddy_stats(buddy_stats_t *stats)
+{
+	buddy_arena_stats(&default_arena, stats);
+}
+
+/**
+ * Print the status of the default arena
+ */
+void buddy_dump()
+{
+	buddy_arena_dump(&default_arena);
+}
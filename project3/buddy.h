@@ -1,9 +1,69 @@
 #ifndef BUDDY_H
 #define BUDDY_H
 
+#include <stddef.h>
+
+/* buddy_map_region() flag: back the region with transparent huge pages */
+#define BUDDY_MAP_HUGEPAGE 1
+
+/* Opaque handle to an independent buddy arena */
+typedef struct buddy_arena buddy_arena_t;
+
+/* Occupancy, fragmentation and event counters of an arena */
+typedef struct buddy_stats_t {
+	int min_order;                  ///< Order of the smallest block
+	int max_order;                  ///< Order of the whole arena
+	size_t bytes_in_use;            ///< Bytes in allocated blocks
+	size_t bytes_free;              ///< Bytes on the free lists
+	size_t high_water;              ///< Peak of bytes_in_use
+	size_t bytes_requested;         ///< Bytes asked for by all allocations so far
+	size_t bytes_granted;           ///< Bytes handed out by all allocations so far
+	double internal_frag;           ///< 1 - bytes_requested / bytes_granted
+	double ext_frag[sizeof(unsigned long) * 8]; ///< Per order: share of free bytes in blocks too small for that order
+	unsigned long allocs;           ///< Successful allocations
+	unsigned long frees;            ///< Blocks freed
+	unsigned long splits;           ///< Blocks split in two
+	unsigned long merges;           ///< Buddy pairs coalesced
+	unsigned long failed;           ///< Allocations that returned NULL
+	size_t bytes_released;          ///< Bytes of free blocks given back to the OS so far
+} buddy_stats_t;
+
+buddy_arena_t *buddy_arena_create(void *base, size_t size, int min_order);
+void buddy_arena_destroy(buddy_arena_t *arena);
+void *buddy_arena_alloc(buddy_arena_t *arena, size_t size);
+void buddy_arena_free(buddy_arena_t *arena, void *addr);
+void *buddy_arena_alloc_aligned(buddy_arena_t *arena, size_t size, size_t align);
+void *buddy_arena_realloc(buddy_arena_t *arena, void *addr, size_t size);
+void buddy_arena_dump(buddy_arena_t *arena);
+void buddy_arena_stats(buddy_arena_t *arena, buddy_stats_t *stats);
+int buddy_arena_alloc_bulk(buddy_arena_t *arena, int order, int n, void **out);
+void buddy_arena_free_bulk(buddy_arena_t *arena, void **ptrs, int n);
+int buddy_arena_set_concurrent(buddy_arena_t *arena, int n_caches);
+void buddy_arena_drain(buddy_arena_t *arena);
+int buddy_arena_set_decay(buddy_arena_t *arena, int order, long decay_ms);
+size_t buddy_arena_trim(buddy_arena_t *arena);
+size_t buddy_arena_decay(buddy_arena_t *arena);
+size_t buddy_arena_page_size(buddy_arena_t *arena);
+void *buddy_arena_block_start(buddy_arena_t *arena, void *addr, int order);
+
+/* Backing memory for arenas */
+void *buddy_map_region(size_t size, int flags);
+void buddy_unmap_region(void *base, size_t size);
+
+/* Wrappers over the default arena */
+buddy_arena_t *buddy_default_arena();
 void buddy_init();
+int buddy_init_ex(void *base, size_t size, int min_order);
 void *buddy_alloc(int size);
 void buddy_free(void *addr);
+void *buddy_alloc_aligned(int size, size_t align);
+void *buddy_realloc(void *addr, int size);
+int buddy_alloc_bulk(int order, int n, void **out);
+void buddy_free_bulk(void **ptrs, int n);
+int buddy_set_decay(int order, long decay_ms);
+size_t buddy_trim();
+size_t buddy_decay();
 void buddy_dump();
+void buddy_stats(buddy_stats_t *stats);
 
 #endif // BUDDY_H
@@ -0,0 +1,902 @@
+/**
+ * Unit checks for the buddy allocator
+ *
+ * The command scripts under test-files only exercise the default arena from
+ * a single thread. The checks here cover the rest of the API. Each check
+ * prints its name followed by "ok" or by every condition that failed, and the
+ * program exits non-zero if anything failed.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "buddy.h"
+#include "slab.h"
+
+/**
+ * Record a failed condition without stopping the check
+ */
+#define CHECK(cond)                                                          \
+	do {                                                                 \
+		if (!(cond)) {                                               \
+			printf("\n    %s:%d: %s", __FILE__, __LINE__, #cond); \
+			failures++;                                          \
+		}                                                            \
+	} while (0)
+
+/**
+ * Number of threads of the concurrent checks
+ */
+#define THREADS 8
+
+/**
+ * Blocks each thread of the concurrent checks keeps live at once
+ */
+#define LIVE_BLOCKS 64
+
+/**
+ * Objects each slab check allocates, enough to need several slabs
+ */
+#define SLAB_OBJECTS 200
+
+/**
+ * One thread of a concurrent check
+ */
+typedef struct worker_t {
+	buddy_arena_t *arena;      ///< Shared arena
+	char *memory;              ///< Start of the arena's region
+	unsigned char *owner;      ///< Per page: 0 if free, else the owning thread + 1
+	int id;                    ///< Thread number
+	long ops;                  ///< Number of operations to run
+} worker_t;
+
+static int failures = 0;        // Conditions failed so far
+static int workers_done = 0;    // Set once the workers of a concurrent check finish
+
+/**
+ * xorshift64 random number generator
+ *
+ * @param state Generator state, updated in place
+ * @return Next pseudo-random number
+ */
+static inline unsigned long next_rand(unsigned long *state)
+{
+	unsigned long x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/**
+ * Order of the block the allocator hands out for a request
+ *
+ * @param arena Arena the request goes to
+ * @param size Bytes asked for
+ * @return Order of the block
+ */
+static int block_order(buddy_arena_t *arena, size_t size)
+{
+	size_t page = buddy_arena_page_size(arena);
+	int order = __builtin_ctzl(page);
+
+	while ((1UL << order) < size)
+		order++;
+
+	return order;
+}
+
+/**
+ * Check that an arena has no block in use and is one whole free block
+ *
+ * @param arena Arena to check
+ * @param size Size of the arena's region
+ */
+static void check_coalesced(buddy_arena_t *arena, size_t size)
+{
+	buddy_stats_t stats;
+
+	buddy_arena_stats(arena, &stats);
+
+	CHECK(stats.bytes_in_use == 0);
+	CHECK(stats.bytes_free == size);
+
+	// With everything free, any free block below the top order is a missed merge
+	CHECK(stats.ext_frag[stats.max_order] == 0.0);
+}
+
+/**
+ * Claim or release the pages of a block in a shared ownership map
+ *
+ * Claiming fails if another thread already owns any of the pages, i.e. if the
+ * allocator handed out the same memory twice.
+ *
+ * @param w Worker claiming the block
+ * @param addr Start of the block
+ * @param order Order of the block
+ * @param claim 1 to claim the pages, 0 to release them
+ * @return 1 if every page changed hands as expected, else 0
+ */
+static int set_owner(worker_t *w, char *addr, int order, int claim)
+{
+	size_t page = buddy_arena_page_size(w->arena);
+	size_t first = (addr - w->memory) / page;
+	size_t n = ((1UL << order) + page - 1) / page;
+	unsigned char me = w->id + 1;
+	size_t i;
+	int ok = 1;
+
+	for (i = first; i < first + n; i++) {
+		unsigned char expected = claim ? 0 : me;
+
+		if (!__atomic_compare_exchange_n(&w->owner[i], &expected, claim ? me : 0, 0,
+		                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			ok = 0;
+	}
+
+	return ok;
+}
+
+/**
+ * Worker of the concurrent check: random allocations and frees, each block
+ * claimed in the ownership map and stamped with the thread number
+ *
+ * @param arg Pointer to this thread's worker_t
+ * @return Number of ownership or stamp violations seen, cast to a pointer
+ */
+static void *ownership_worker(void *arg)
+{
+	worker_t *w = arg;
+	void *live[LIVE_BLOCKS];
+	size_t sizes[LIVE_BLOCKS];
+	unsigned long rng = 0x9e3779b97f4a7c15UL * (w->id + 1);
+	long violations = 0;
+	long i;
+	int slot;
+
+	memset(live, 0, sizeof(live));
+
+	for (i = 0; i < w->ops; i++) {
+		unsigned long r = next_rand(&rng);
+		slot = r % LIVE_BLOCKS;
+
+		if (live[slot] != NULL) {
+			unsigned char *block = live[slot];
+
+			if (block[0] != w->id || block[sizes[slot] - 1] != w->id)
+				violations++;
+
+			if (!set_owner(w, live[slot], block_order(w->arena, sizes[slot]), 0))
+				violations++;
+
+			buddy_arena_free(w->arena, live[slot]);
+			live[slot] = NULL;
+			continue;
+		}
+
+		// Mostly single pages, which go through the per-CPU caches
+		sizes[slot] = (r >> 16) % 4 != 0 ? 1 + (r >> 24) % 4096 : 4096 * (2 + (r >> 24) % 7);
+		live[slot] = buddy_arena_alloc(w->arena, sizes[slot]);
+
+		if (live[slot] == NULL)
+			continue;
+
+		if (!set_owner(w, live[slot], block_order(w->arena, sizes[slot]), 1))
+			violations++;
+
+		memset(live[slot], w->id, sizes[slot]);
+	}
+
+	for (slot = 0; slot < LIVE_BLOCKS; slot++) {
+		if (live[slot] != NULL) {
+			set_owner(w, live[slot], block_order(w->arena, sizes[slot]), 0);
+			buddy_arena_free(w->arena, live[slot]);
+		}
+	}
+
+	return (void *)violations;
+}
+
+/**
+ * Trim an arena over and over until the workers are done
+ *
+ * A purge that reached a block in use would zero it under its owner, which
+ * then sees its stamp gone.
+ *
+ * @param arg Arena to trim
+ * @return NULL
+ */
+static void *trim_worker(void *arg)
+{
+	while (!__atomic_load_n(&workers_done, __ATOMIC_ACQUIRE))
+		buddy_arena_trim(arg);
+
+	return NULL;
+}
+
+/**
+ * Hammer one shared arena from several threads and check that no block is
+ * ever handed to two threads at once and that everything merges back
+ *
+ * @param n_caches Number of per-CPU caches, 0 for the arena lock only
+ * @param trim Nonzero to trim the arena from another thread meanwhile
+ */
+static void check_concurrent(int n_caches, int trim)
+{
+	size_t size = 1UL << 24;
+	char *memory = buddy_map_region(size, 0);
+	buddy_arena_t *arena = buddy_arena_create(memory, size, 12);
+	unsigned char *owner = calloc(size >> 12, 1);
+	pthread_t tids[THREADS], trimmer;
+	worker_t workers[THREADS];
+	void *violations;
+	int i;
+
+	CHECK(memory != NULL && arena != NULL && owner != NULL);
+	if (memory == NULL || arena == NULL || owner == NULL)
+		return;
+
+	CHECK(buddy_arena_set_concurrent(arena, n_caches) == 0);
+
+	workers_done = 0;
+	if (trim)
+		pthread_create(&trimmer, NULL, trim_worker, arena);
+
+	for (i = 0; i < THREADS; i++) {
+		workers[i] = (worker_t){ arena, memory, owner, i, 200000 };
+		pthread_create(&tids[i], NULL, ownership_worker, &workers[i]);
+	}
+
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(tids[i], &violations);
+		CHECK(violations == NULL);
+	}
+
+	__atomic_store_n(&workers_done, 1, __ATOMIC_RELEASE);
+	if (trim)
+		pthread_join(trimmer, NULL);
+
+	for (i = 0; i < (int)(size >> 12); i++)
+		CHECK(owner[i] == 0);
+
+	buddy_arena_drain(arena);
+	check_coalesced(arena, size);
+
+	buddy_arena_destroy(arena);
+	buddy_unmap_region(memory, size);
+	free(owner);
+}
+
+/**
+ * Concurrent mode with only the arena lock
+ */
+static void test_concurrent_locked()
+{
+	check_concurrent(0, 0);
+}
+
+/**
+ * Concurrent mode with per-CPU page caches, fewer than the threads so that
+ * threads on different CPUs share a cache
+ */
+static void test_concurrent_pcp()
+{
+	check_concurrent(2, 0);
+}
+
+/**
+ * Concurrent mode while another thread keeps trimming the arena
+ */
+static void test_concurrent_trim()
+{
+	check_concurrent(2, 1);
+}
+
+/**
+ * Mark the pages of a block as taken in a single-threaded ownership map
+ *
+ * @param taken One byte per page of the arena, nonzero if handed out
+ * @param memory Start of the arena's region
+ * @param addr Start of the block
+ * @param bytes Size of the block
+ * @return 1 if none of the pages was taken yet, else 0
+ */
+static int take_pages(unsigned char *taken, char *memory, void *addr, size_t bytes)
+{
+	size_t first = ((char *)addr - memory) >> 12;
+	size_t i;
+	int ok = 1;
+
+	for (i = first; i < first + (bytes >> 12); i++) {
+		if (taken[i])
+			ok = 0;
+		taken[i] = 1;
+	}
+
+	return ok;
+}
+
+/**
+ * Bulk allocation that can only partly succeed
+ */
+static void test_bulk_partial()
+{
+	size_t size = 1UL << 20;
+	char *memory = buddy_map_region(size, 0);
+	buddy_arena_t *arena = buddy_arena_create(memory, size, 12);
+	buddy_stats_t stats;
+	void *pin, *out[8];
+	int got, i;
+
+	CHECK(memory != NULL && arena != NULL);
+	if (memory == NULL || arena == NULL)
+		return;
+
+	// One page in use leaves room for three of the four 256K blocks
+	pin = buddy_arena_alloc(arena, 1);
+	got = buddy_arena_alloc_bulk(arena, 18, 8, out);
+	CHECK(got == 3);
+
+	for (i = 0; i < got; i++) {
+		CHECK(((char *)out[i] - memory) % (1UL << 18) == 0);
+		CHECK((char *)pin < (char *)out[i] || (char *)pin >= (char *)out[i] + (1UL << 18));
+	}
+
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.failed == 5);
+	CHECK(stats.bytes_in_use == (3UL << 18) + 4096);
+
+	// Nothing left at that order, the batch comes back empty
+	CHECK(buddy_arena_alloc_bulk(arena, 18, 8, out + got) == 0);
+
+	buddy_arena_free_bulk(arena, out, got);
+	buddy_arena_free(arena, pin);
+	check_coalesced(arena, size);
+
+	buddy_arena_destroy(arena);
+	buddy_unmap_region(memory, size);
+}
+
+/**
+ * One bulk free of blocks of several orders, from single and bulk
+ * allocations, in an order unrelated to their addresses
+ */
+static void test_bulk_mixed()
+{
+	static const int orders[] = { 12, 14, 13, 16, 12, 15 };
+	size_t size = 1UL << 20;
+	char *memory = buddy_map_region(size, 0);
+	buddy_arena_t *arena = buddy_arena_create(memory, size, 12);
+	unsigned char taken[256] = { 0 };
+	void *blocks[64], *batch[64];
+	size_t bytes[64];
+	int n = 0, got, i, j;
+
+	CHECK(memory != NULL && arena != NULL);
+	if (memory == NULL || arena == NULL)
+		return;
+
+	for (i = 0; i < (int)(sizeof(orders) / sizeof(orders[0])); i++) {
+		got = buddy_arena_alloc_bulk(arena, orders[i], 4, blocks + n);
+		CHECK(got == 4);
+
+		for (j = 0; j < got; j++)
+			bytes[n++] = 1UL << orders[i];
+
+		blocks[n] = buddy_arena_alloc(arena, 3 << (orders[i] - 2));
+		CHECK(blocks[n] != NULL);
+		bytes[n++] = 1UL << orders[i];
+	}
+
+	for (i = 0; i < n; i++) {
+		CHECK(take_pages(taken, memory, blocks[i], bytes[i]));
+		memset(blocks[i], i, bytes[i]);
+	}
+
+	for (i = 0; i < n; i++)
+		CHECK(((unsigned char *)blocks[i])[bytes[i] - 1] == i);
+
+	// Stride through the blocks so neighbours are freed far apart
+	for (i = 0; i < n; i++)
+		batch[i] = blocks[(i * 7) % n];
+
+	buddy_arena_free_bulk(arena, batch, n);
+	check_coalesced(arena, size);
+
+	buddy_arena_destroy(arena);
+	buddy_unmap_region(memory, size);
+}
+
+/**
+ * Bulk calls on a concurrent arena whose per-CPU cache holds free pages
+ *
+ * A bulk allocation must not hand out a page sitting in a cache, and a bulk
+ * free may return pages that were allocated through a cache.
+ */
+static void test_bulk_pcp()
+{
+	size_t size = 1UL << 20;
+	char *memory = buddy_map_region(size, 0);
+	buddy_arena_t *arena = buddy_arena_create(memory, size, 12);
+	unsigned char taken[256] = { 0 };
+	void *blocks[256];
+	int n = 0, got, i;
+
+	CHECK(memory != NULL && arena != NULL);
+	if (memory == NULL || arena == NULL)
+		return;
+
+	CHECK(buddy_arena_set_concurrent(arena, 1) == 0);
+
+	// Pages through the cache, half of them freed back into it
+	for (i = 0; i < 40; i++)
+		blocks[n++] = buddy_arena_alloc(arena, 4096);
+	for (i = 0; i < 20; i++)
+		buddy_arena_free(arena, blocks[--n]);
+
+	got = buddy_arena_alloc_bulk(arena, 12, 256, blocks + n);
+	CHECK(got > 0 && got < 256 - n);
+	n += got;
+
+	// What is left comes out of the cache
+	while (n < 256 && (blocks[n] = buddy_arena_alloc(arena, 4096)) != NULL)
+		n++;
+	CHECK(n == 256);
+
+	for (i = 0; i < n; i++)
+		CHECK(take_pages(taken, memory, blocks[i], 4096));
+
+	buddy_arena_free_bulk(arena, blocks, n);
+	buddy_arena_drain(arena);
+	check_coalesced(arena, size);
+
+	buddy_arena_destroy(arena);
+	buddy_unmap_region(memory, size);
+}
+
+/**
+ * Aligned allocation above and below the order of the block
+ */
+static void test_aligned()
+{
+	static const size_t sizes[] = { 1, 4096, 5000, 40000 };
+	size_t size = 1UL << 26;
+	char *memory = buddy_map_region(size, 0);
+	buddy_arena_t *arena = buddy_arena_create(memory, size, 12);
+	buddy_arena_t *offset;
+	buddy_stats_t stats;
+	void *pin, *blocks[64], *addr;
+	size_t align, in_use;
+	int n = 0, i;
+
+	CHECK(memory != NULL && arena != NULL);
+	if (memory == NULL || arena == NULL)
+		return;
+
+	// A page in use at the start so aligned blocks cannot all come first
+	pin = buddy_arena_alloc(arena, 1);
+
+	for (align = 4096; align <= (1UL << 20); align <<= 1) {
+		for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+			buddy_arena_stats(arena, &stats);
+			in_use = stats.bytes_in_use;
+
+			addr = buddy_arena_alloc_aligned(arena, sizes[i], align);
+			CHECK(addr != NULL && ((char *)addr - memory) % align == 0);
+			if (addr == NULL)
+				continue;
+
+			// The tail of the aligned block went straight back
+			buddy_arena_stats(arena, &stats);
+			CHECK(stats.bytes_in_use - in_use == 1UL << block_order(arena, sizes[i]));
+
+			memset(addr, 0xa5, sizes[i]);
+			blocks[n++] = addr;
+		}
+	}
+
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.failed == 0);
+
+	// Not a power of two, zero, or larger than the arena
+	CHECK(buddy_arena_alloc_aligned(arena, 100, 3 * 4096) == NULL);
+	CHECK(buddy_arena_alloc_aligned(arena, 100, 24) == NULL);
+	CHECK(buddy_arena_alloc_aligned(arena, 100, 0) == NULL);
+	CHECK(buddy_arena_alloc_aligned(arena, 100, size * 2) == NULL);
+
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.failed == 4);
+
+	for (i = 0; i < n; i++)
+		buddy_arena_free(arena, blocks[i]);
+	buddy_arena_free(arena, pin);
+	check_coalesced(arena, size);
+	buddy_arena_destroy(arena);
+
+	// An arena starting one page in cannot promise more than a page
+	offset = buddy_arena_create(memory + 4096, 1UL << 20, 12);
+	CHECK(offset != NULL);
+	if (offset != NULL) {
+		addr = buddy_arena_alloc_aligned(offset, 100, 4096);
+		CHECK(addr != NULL);
+		CHECK(buddy_arena_alloc_aligned(offset, 100, 8192) == NULL);
+		buddy_arena_free(offset, addr);
+		buddy_arena_destroy(offset);
+	}
+
+	buddy_unmap_region(memory, size);
+}
+
+/**
+ * Whether the mapping holding an address is marked for transparent huge pages
+ *
+ * @param addr Address inside the mapping
+ * @return 1 if its VmFlags include "hg", 0 if not, -1 if smaps is unreadable
+ */
+static int mapping_has_hugepage(void *addr)
+{
+	FILE *smaps = fopen("/proc/self/smaps", "r");
+	char line[512];
+	unsigned long start, end;
+	int inside = 0, found = 0;
+
+	if (smaps == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), smaps) != NULL) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+			inside = start <= (unsigned long)addr && (unsigned long)addr < end;
+		else if (inside && strncmp(line, "VmFlags:", 8) == 0)
+			found = strstr(line, " hg") != NULL;
+	}
+
+	fclose(smaps);
+	return found;
+}
+
+/**
+ * Regions from buddy_map_region(), with and without huge pages
+ */
+static void test_map_region()
+{
+	size_t size = 1UL << 23;
+	char *memory = buddy_map_region(size, BUDDY_MAP_HUGEPAGE);
+	char *small = buddy_map_region(1UL << 16, 0);
+	buddy_arena_t *arena;
+	void *addr;
+
+	CHECK(memory != NULL && small != NULL);
+	if (memory == NULL || small == NULL)
+		return;
+
+	// Aligned to its size, or to a huge page if it is smaller
+	CHECK((unsigned long)memory % size == 0);
+	CHECK((unsigned long)small % (1UL << 21) == 0);
+
+	// Only expect the flag where the kernel has transparent huge pages
+	if (access("/sys/kernel/mm/transparent_hugepage/enabled", F_OK) == 0) {
+		CHECK(mapping_has_hugepage(memory) == 1);
+		CHECK(mapping_has_hugepage(small) == 0);
+	}
+
+	// A huge-page-aligned block of a huge page region is usable end to end
+	arena = buddy_arena_create(memory, size, 12);
+	CHECK(arena != NULL);
+	if (arena != NULL) {
+		addr = buddy_arena_alloc_aligned(arena, 1UL << 21, 1UL << 21);
+		CHECK(addr != NULL && (unsigned long)addr % (1UL << 21) == 0);
+		if (addr != NULL) {
+			memset(addr, 0x5a, 1UL << 21);
+			buddy_arena_free(arena, addr);
+		}
+		check_coalesced(arena, size);
+		buddy_arena_destroy(arena);
+	}
+
+	CHECK(buddy_map_region(3UL << 20, 0) == NULL);
+	CHECK(buddy_map_region(0, 0) == NULL);
+
+	buddy_unmap_region(memory, size);
+	buddy_unmap_region(small, 1UL << 16);
+}
+
+/**
+ * Count the pages of a range that are resident in memory
+ *
+ * @param addr Start of the range, page aligned
+ * @param bytes Length of the range
+ * @return Number of resident OS pages
+ */
+static size_t resident_pages(void *addr, size_t bytes)
+{
+	size_t os_page = sysconf(_SC_PAGESIZE);
+	size_t n = bytes / os_page, count = 0, i;
+	unsigned char *vec = malloc(n);
+
+	if (vec == NULL || mincore(addr, bytes, vec) != 0) {
+		free(vec);
+		return (size_t)-1;
+	}
+
+	for (i = 0; i < n; i++)
+		count += vec[i] & 1;
+
+	free(vec);
+	return count;
+}
+
+/**
+ * Sleep for some milliseconds
+ *
+ * @param ms Milliseconds to sleep
+ */
+static void sleep_ms(long ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+
+	nanosleep(&ts, NULL);
+}
+
+/**
+ * Allocate a block and touch every byte of it
+ *
+ * @param arena Arena to allocate from
+ * @param bytes Size of the block
+ * @return The block
+ */
+static void *alloc_dirty(buddy_arena_t *arena, size_t bytes)
+{
+	void *addr = buddy_arena_alloc(arena, bytes);
+
+	if (addr != NULL)
+		memset(addr, 0xc3, bytes);
+
+	return addr;
+}
+
+/**
+ * Trimming releases every free block once and leaves blocks in use alone
+ */
+static void test_trim()
+{
+	size_t size = 1UL << 22;
+	char *memory = buddy_map_region(size, 0);
+	buddy_arena_t *arena = buddy_arena_create(memory, size, 12);
+	buddy_stats_t stats;
+	unsigned char *keep, *addr;
+
+	CHECK(memory != NULL && arena != NULL);
+	if (memory == NULL || arena == NULL)
+		return;
+
+	keep = alloc_dirty(arena, 1UL << 20);
+	addr = alloc_dirty(arena, 1UL << 20);
+	CHECK(keep != NULL && addr != NULL);
+	if (keep == NULL || addr == NULL)
+		return;
+
+	buddy_arena_free(arena, addr);
+	CHECK(resident_pages(addr, 1UL << 20) > 0);
+
+	// Only the freed block was ever dirtied
+	CHECK(buddy_arena_trim(arena) == 1UL << 20);
+	CHECK(resident_pages(addr, 1UL << 20) == 0);
+	CHECK(resident_pages(keep, 1UL << 20) == (1UL << 20) / sysconf(_SC_PAGESIZE));
+	CHECK(keep[0] == 0xc3 && keep[(1UL << 20) - 1] == 0xc3);
+
+	// Purged blocks are not purged again, and read back as zeros
+	CHECK(buddy_arena_trim(arena) == 0);
+	addr = buddy_arena_alloc(arena, 1UL << 20);
+	CHECK(addr != NULL && addr[0] == 0 && addr[(1UL << 20) - 1] == 0);
+
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.bytes_released == 1UL << 20);
+
+	buddy_arena_free(arena, addr);
+	buddy_arena_free(arena, keep);
+	check_coalesced(arena, size);
+
+	buddy_arena_destroy(arena);
+	buddy_unmap_region(memory, size);
+}
+
+/**
+ * Decay releases free blocks only after they sat idle for a whole period,
+ * whether the clock is run by frees, by allocations or by the tick
+ */
+static void test_decay()
+{
+	size_t size = 1UL << 22, block = 1UL << 20, released;
+	char *memory = buddy_map_region(size, 0);
+	buddy_arena_t *arena = buddy_arena_create(memory, size, 12);
+	buddy_stats_t stats;
+	void *addr, *first, *second;
+
+	CHECK(memory != NULL && arena != NULL);
+	if (memory == NULL || arena == NULL)
+		return;
+
+	CHECK(buddy_arena_set_decay(arena, 16, 50) == 0);
+	CHECK(buddy_arena_set_decay(arena, 23, 50) == -1);
+
+	// Idle arena: only the tick runs the clock
+	addr = alloc_dirty(arena, block);
+	buddy_arena_free(arena, addr);
+	CHECK(buddy_arena_decay(arena) == 0);
+
+	// One period in, the block has not been idle for a whole one yet
+	sleep_ms(60);
+	CHECK(buddy_arena_decay(arena) == 0);
+	CHECK(resident_pages(addr, block) > 0);
+
+	sleep_ms(60);
+	CHECK(buddy_arena_decay(arena) == size);
+	CHECK(resident_pages(addr, block) == 0);
+
+	// An arena that only allocates still decays
+	addr = alloc_dirty(arena, block);
+	buddy_arena_free(arena, addr);
+	buddy_arena_stats(arena, &stats);
+	released = stats.bytes_released;
+
+	sleep_ms(60);
+	first = buddy_arena_alloc(arena, 1UL << 16);
+	sleep_ms(60);
+	second = buddy_arena_alloc(arena, 1UL << 16);
+
+	buddy_arena_stats(arena, &stats);
+	CHECK(first != NULL && second != NULL && stats.bytes_released > released);
+	buddy_arena_free(arena, first);
+	buddy_arena_free(arena, second);
+
+	// With no delay the freed block goes right away
+	CHECK(buddy_arena_set_decay(arena, 16, 0) == 0);
+	addr = alloc_dirty(arena, block);
+	buddy_arena_free(arena, addr);
+	CHECK(resident_pages(addr, block) == 0);
+
+	// Turned off, nothing decays
+	CHECK(buddy_arena_set_decay(arena, -1, 0) == 0);
+	addr = alloc_dirty(arena, block);
+	buddy_arena_free(arena, addr);
+	CHECK(buddy_arena_decay(arena) == 0);
+	CHECK(resident_pages(addr, block) > 0);
+
+	check_coalesced(arena, size);
+
+	buddy_arena_destroy(arena);
+	buddy_unmap_region(memory, size);
+}
+
+/**
+ * Fill a cache, check every object's alignment and contents, then free the
+ * objects in a scrambled order
+ *
+ * @param arena Arena the cache takes slabs from
+ * @param size Object size
+ * @param align Alignment asked for
+ */
+static void check_slab(buddy_arena_t *arena, size_t size, size_t align)
+{
+	slab_cache_t *cache = slab_create_arena(arena, size, align);
+	size_t want = align < __alignof__(void *) ? __alignof__(void *) : align;
+	unsigned char *objs[SLAB_OBJECTS];
+	int i, j;
+
+	CHECK(cache != NULL);
+	if (cache == NULL)
+		return;
+
+	for (i = 0; i < SLAB_OBJECTS; i++) {
+		objs[i] = slab_alloc(cache);
+		CHECK(objs[i] != NULL);
+		if (objs[i] == NULL)
+			return;
+
+		CHECK((uintptr_t)objs[i] % want == 0);
+		memset(objs[i], i, size);
+	}
+
+	// An object overlapping another one would have been overwritten
+	for (i = 0; i < SLAB_OBJECTS; i++)
+		CHECK(objs[i][0] == (unsigned char)i && objs[i][size - 1] == (unsigned char)i);
+
+	// Odd indexes first, then even ones, so slabs go partial before empty
+	for (j = 1; j >= 0; j--)
+		for (i = j; i < SLAB_OBJECTS; i += 2)
+			slab_free(cache, objs[i]);
+
+	// Freed slots are handed out again, still aligned
+	objs[0] = slab_alloc(cache);
+	CHECK(objs[0] != NULL && (uintptr_t)objs[0] % want == 0);
+	slab_free(cache, objs[0]);
+
+	slab_destroy(cache);
+}
+
+/**
+ * Slab caches with odd sizes and alignments, on an arena whose base is not
+ * aligned to anything more than 8 bytes
+ */
+static void test_slab()
+{
+	static const size_t sizes[] = { 1, 3, 9, 24, 100, 1000, 3000 };
+	static const size_t aligns[] = { 0, 1, 2, 8, 16, 64, 4096 };
+	size_t size = 1UL << 22;
+	char *memory = buddy_map_region(size * 2, 0);
+	buddy_arena_t *arena = buddy_arena_create(memory + 8, size, 12);
+	size_t i, j;
+
+	CHECK(memory != NULL && arena != NULL);
+	if (memory == NULL || arena == NULL)
+		return;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		for (j = 0; j < sizeof(aligns) / sizeof(aligns[0]); j++)
+			check_slab(arena, sizes[i], aligns[j]);
+
+	// Alignment must be a power of two no larger than a page
+	CHECK(slab_create_arena(arena, 16, 24) == NULL);
+	CHECK(slab_create_arena(arena, 16, 8192) == NULL);
+	CHECK(slab_create_arena(arena, 0, 8) == NULL);
+
+	check_coalesced(arena, size);
+
+	buddy_arena_destroy(arena);
+	buddy_unmap_region(memory, size * 2);
+}
+
+/**
+ * A named check
+ */
+typedef struct test_t {
+	const char *name;
+	void (*run)();
+} test_t;
+
+static const test_t tests[] = {
+	{ "concurrent, arena lock only", test_concurrent_locked },
+	{ "concurrent, per-CPU caches", test_concurrent_pcp },
+	{ "concurrent, trimming", test_concurrent_trim },
+	{ "bulk, partial failure", test_bulk_partial },
+	{ "bulk, mixed orders", test_bulk_mixed },
+	{ "bulk, per-CPU caches", test_bulk_pcp },
+	{ "aligned allocation", test_aligned },
+	{ "mapped regions", test_map_region },
+	{ "trim", test_trim },
+	{ "decay", test_decay },
+	{ "slab caches", test_slab },
+};
+
+int main()
+{
+	size_t i;
+	int failed_tests = 0;
+
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		int before = failures;
+
+		printf("%s:", tests[i].name);
+		fflush(stdout);
+
+		tests[i].run();
+
+		if (failures == before) {
+			printf(" ok\n");
+		}
+		else {
+			printf("\n");
+			failed_tests++;
+		}
+	}
+
+	printf("%d of %zu checks failed\n", failed_tests, i);
+	return failed_tests == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
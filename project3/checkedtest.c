@@ -0,0 +1,313 @@
+/**
+ * Checks for the heap checks of a USE_CHECKED build
+ *
+ * Linked against buddy.c compiled with -DUSE_CHECKED=1. Each misuse runs in a
+ * child process, which must abort with the matching message on stderr; each
+ * correct use must run to completion. The output format and exit status
+ * follow buddytest.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "buddy.h"
+
+/**
+ * Record a failed condition without stopping the check
+ */
+#define CHECK(cond)                                                          \
+	do {                                                                 \
+		if (!(cond)) {                                               \
+			printf("\n    %s:%d: %s", __FILE__, __LINE__, #cond); \
+			failures++;                                          \
+		}                                                            \
+	} while (0)
+
+/**
+ * Size of the arena each case runs on
+ */
+#define ARENA_SIZE (1UL << 20)
+
+static int failures = 0;        // Conditions failed so far
+
+/**
+ * Run a case on a fresh arena in a child process
+ *
+ * @param run Case to run, on an arena of ARENA_SIZE bytes with 4K pages
+ * @param concurrent Nonzero to switch the arena to concurrent mode first
+ * @param expect Text the child must print on stderr before aborting, or
+ * NULL if it must exit normally
+ * @return 1 if the child behaved as expected, else 0
+ */
+static int run_child(void (*run)(buddy_arena_t *), int concurrent, const char *expect)
+{
+	char output[512];
+	int fds[2], status;
+	ssize_t len = 0, n;
+	pid_t pid;
+
+	fflush(stdout);
+	if (pipe(fds) != 0 || (pid = fork()) < 0)
+		return 0;
+
+	if (pid == 0) {
+		void *memory = buddy_map_region(ARENA_SIZE, 0);
+		buddy_arena_t *arena = buddy_arena_create(memory, ARENA_SIZE, 12);
+
+		dup2(fds[1], STDERR_FILENO);
+		close(fds[0]);
+
+		if (arena == NULL || (concurrent && buddy_arena_set_concurrent(arena, 4) != 0))
+			_exit(2);
+
+		run(arena);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	while (len < (ssize_t)sizeof(output) - 1
+	       && (n = read(fds[0], output + len, sizeof(output) - 1 - len)) > 0)
+		len += n;
+	output[len] = '\0';
+	close(fds[0]);
+
+	waitpid(pid, &status, 0);
+
+	if (expect == NULL)
+		return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+	return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT && strstr(output, expect) != NULL;
+}
+
+/**
+ * Free the same block twice
+ */
+static void double_free(buddy_arena_t *arena)
+{
+	void *addr = buddy_arena_alloc(arena, 100);
+
+	buddy_arena_free(arena, addr);
+	buddy_arena_free(arena, addr);
+}
+
+/**
+ * Free a block that has since merged into a larger free block
+ */
+static void double_free_merged(buddy_arena_t *arena)
+{
+	char *left = buddy_arena_alloc(arena, 4096);
+	char *right = buddy_arena_alloc(arena, 4096);
+
+	buddy_arena_free(arena, left);
+	buddy_arena_free(arena, right);
+	buddy_arena_free(arena, right);
+}
+
+/**
+ * Free a pointer into the middle of a block
+ */
+static void interior_pointer(buddy_arena_t *arena)
+{
+	char *addr = buddy_arena_alloc(arena, 20000);
+
+	buddy_arena_free(arena, addr + 8192);
+}
+
+/**
+ * Free a pointer that is not page aligned
+ */
+static void unaligned_pointer(buddy_arena_t *arena)
+{
+	char *addr = buddy_arena_alloc(arena, 100);
+
+	buddy_arena_free(arena, addr + 16);
+}
+
+/**
+ * Free memory that does not belong to the arena
+ */
+static void foreign_pointer(buddy_arena_t *arena)
+{
+	static char other[4096] __attribute__((aligned(4096)));
+
+	buddy_arena_alloc(arena, 100);
+	buddy_arena_free(arena, other);
+}
+
+/**
+ * Overwrite the canary trailer at the end of a block
+ */
+static void canary(buddy_arena_t *arena)
+{
+	char *addr = buddy_arena_alloc(arena, 100);
+
+	memset(addr + 4096 - 8, 0, 8);
+	buddy_arena_free(arena, addr);
+}
+
+/**
+ * Write one byte past the end of a request
+ */
+static void red_zone(buddy_arena_t *arena)
+{
+	char *addr = buddy_arena_alloc(arena, 100);
+
+	addr[100] = 0;
+	buddy_arena_free(arena, addr);
+}
+
+/**
+ * Write one byte past a request that exactly fills a page
+ */
+static void red_zone_exact_fit(buddy_arena_t *arena)
+{
+	char *addr = buddy_arena_alloc(arena, 4096);
+
+	addr[4096] = 0;
+	buddy_arena_free(arena, addr);
+}
+
+/**
+ * Write past the new end of a block shrunk in place
+ */
+static void red_zone_after_realloc(buddy_arena_t *arena)
+{
+	char *addr = buddy_arena_alloc(arena, 30000);
+
+	addr = buddy_arena_realloc(arena, addr, 3000);
+	addr[3000] = 0;
+	buddy_arena_free(arena, addr);
+}
+
+/**
+ * Resize a block that was already freed
+ */
+static void realloc_freed(buddy_arena_t *arena)
+{
+	void *addr = buddy_arena_alloc(arena, 100);
+
+	buddy_arena_free(arena, addr);
+	buddy_arena_realloc(arena, addr, 200);
+}
+
+/**
+ * Correct use of every path that writes or checks a guard, ending with the
+ * arena back in one piece
+ */
+static void clean_use(buddy_arena_t *arena)
+{
+	void *blocks[16];
+	buddy_stats_t stats;
+	char *addr;
+	int i, got;
+
+	for (i = 0; i < 16; i++) {
+		blocks[i] = buddy_arena_alloc(arena, 1000 * (i + 1));
+		memset(blocks[i], i, 1000 * (i + 1));
+	}
+
+	for (i = 0; i < 16; i += 2)
+		blocks[i] = buddy_arena_realloc(arena, blocks[i], 500 * (i + 1));
+
+	for (i = 15; i >= 0; i--)
+		buddy_arena_free(arena, blocks[i]);
+
+	// Growing a block whose buddy is taken moves it
+	addr = buddy_arena_alloc(arena, 4000);
+	blocks[0] = buddy_arena_alloc(arena, 4000);
+	memset(addr, 2, 4000);
+	addr = buddy_arena_realloc(arena, addr, 4090);
+	if (addr[3999] != 2)
+		_exit(1);
+	memset(addr, 3, 4090);
+	buddy_arena_free(arena, addr);
+	buddy_arena_free(arena, blocks[0]);
+
+	// Exact fits use the whole request
+	addr = buddy_arena_alloc(arena, 8192);
+	memset(addr, 1, 8192);
+	buddy_arena_free(arena, addr);
+
+	addr = buddy_arena_alloc_aligned(arena, 4096, 65536);
+	memset(addr, 1, 4096);
+	buddy_arena_free(arena, addr);
+
+	got = buddy_arena_alloc_bulk(arena, 12, 16, blocks);
+	buddy_arena_free_bulk(arena, blocks, got);
+
+	buddy_arena_stats(arena, &stats);
+	if (stats.bytes_in_use != 0 || stats.bytes_free != ARENA_SIZE)
+		_exit(1);
+}
+
+/**
+ * A misuse and the diagnosis it must produce
+ */
+typedef struct death_t {
+	const char *name;
+	void (*run)(buddy_arena_t *);
+	const char *expect;
+} death_t;
+
+static const death_t deaths[] = {
+	{ "double free", double_free, "double free" },
+	{ "double free after merging", double_free_merged, "double free" },
+	{ "interior pointer", interior_pointer, "not the start of a block" },
+	{ "unaligned pointer", unaligned_pointer, "not a page of this arena" },
+	{ "foreign pointer", foreign_pointer, "not a page of this arena" },
+	{ "canary", canary, "canary overwritten" },
+	{ "red zone", red_zone, "red zone overwritten" },
+	{ "red zone, exact fit", red_zone_exact_fit, "red zone overwritten" },
+	{ "red zone, after realloc", red_zone_after_realloc, "red zone overwritten" },
+	{ "realloc of a freed block", realloc_freed, "double free" },
+};
+
+/**
+ * Run one case and report it
+ *
+ * @param mode Label of the arena mode
+ * @param name Name of the case
+ * @param run Case to run
+ * @param concurrent Nonzero to run it on a concurrent arena
+ * @param expect Diagnosis the case must abort with, or NULL
+ * @return 1 if the case failed, else 0
+ */
+static int run_case(const char *mode, const char *name, void (*run)(buddy_arena_t *),
+                    int concurrent, const char *expect)
+{
+	int before = failures;
+
+	printf("%s, %s:", mode, name);
+	CHECK(run_child(run, concurrent, expect));
+
+	if (failures == before) {
+		printf(" ok\n");
+		return 0;
+	}
+
+	printf("\n");
+	return 1;
+}
+
+int main()
+{
+	size_t i;
+	int concurrent, failed_tests = 0, total = 0;
+
+	for (concurrent = 0; concurrent <= 1; concurrent++) {
+		const char *mode = concurrent ? "concurrent" : "single-threaded";
+
+		for (i = 0; i < sizeof(deaths) / sizeof(deaths[0]); i++, total++)
+			failed_tests += run_case(mode, deaths[i].name, deaths[i].run, concurrent, deaths[i].expect);
+
+		failed_tests += run_case(mode, "clean use", clean_use, concurrent, NULL);
+		total++;
+	}
+
+	printf("%d of %d checks failed\n", failed_tests, total);
+	return failed_tests == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
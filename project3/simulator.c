@@ -6,8 +6,10 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
 
 #include "buddy.h"
+#include "trace.h"
 
 /**
  * Various program statuses indicating success or failure of an operation
@@ -16,6 +18,7 @@ typedef enum status_t {
 	SUCCESS = 0,
 	OUTOFMEMORY,
 	DOUBLEFREE,
+	INUSE,
 	BADINPUT
 } status_t;
 
@@ -38,6 +41,7 @@ typedef struct var_t {
 
 
 static FILE *in = NULL;    // Input file
+static FILE *csv = NULL;   // Statistics output file, NULL if not requested
 static var_t var_map[256]; // Keep track of variable allocations
 static int linenum = 0;    // Line number in input file
 
@@ -151,6 +155,71 @@ static status_t parse_alloc(char* cmd)
 	return SUCCESS;
 }
 
+/**
+ * Parses a reallocation instruction
+ *
+ * @param cmd String representing a reallocation command in the program,
+ * e.g. "b=realloc(a,8K)"
+ * @returns Status of read and execute
+ */
+static status_t parse_realloc(char* cmd)
+{
+	assert(cmd != NULL);
+
+	char var_name;
+	char src_name;
+	int size;
+	char alter_size;
+	int matched;
+	var_t* var;
+	var_t* src;
+
+	errno = 0;
+	matched = sscanf(cmd, "%c=realloc(%c,%d%c)", &var_name, &src_name, &size, &alter_size);
+
+	if (matched != 4 || errno != 0)
+		return parse_error(cmd);
+
+	switch (alter_size) {
+	case 'k':
+	case 'K':
+		size *= 1024;
+	case ')':
+		break;
+	default:
+		return parse_error(cmd);
+	}
+
+	if ((var = get_var(var_name)) == NULL || (src = get_var(src_name)) == NULL)
+		return parse_error(cmd);
+
+	if (!src->in_use) {
+		print_fault(cmd, "Reallocating a variable that is not in use", ERROR);
+		return DOUBLEFREE;
+	}
+
+	// Resizing in place is fine, overwriting another live variable would leak it
+	if (var != src && var->in_use) {
+		print_fault(cmd, "Reallocating to a variable that is already in use", ERROR);
+		return INUSE;
+	}
+
+	void* mem = buddy_realloc(src->mem, size);
+
+	if (mem == NULL) {
+		print_fault(cmd, "buddy_realloc returned NULL", WARNING);
+		printf("Out of memory\n");
+		return OUTOFMEMORY;
+	}
+
+	src->mem = NULL;
+	src->in_use = false;
+	var->mem = mem;
+	var->in_use = true;
+
+	return SUCCESS;
+}
+
 /**
  * Parses a free instruction
  *
@@ -188,6 +257,46 @@ static status_t parse_free(char* cmd)
 }
 
 
+/**
+ * Write the header of the statistics CSV
+ *
+ * One external fragmentation column is emitted per block order.
+ */
+static void print_stats_header()
+{
+	buddy_stats_t stats;
+
+	buddy_stats(&stats);
+
+	fprintf(csv, "line,bytes_in_use,bytes_free,high_water,bytes_requested,bytes_granted,"
+	        "internal_frag,allocs,frees,splits,merges,failed");
+
+	for (int o = stats.min_order; o <= stats.max_order; ++o)
+		fprintf(csv, ",ext_frag_%luK", (1UL << o) / 1024);
+
+	fprintf(csv, "\n");
+}
+
+/**
+ * Write the current allocator statistics as one CSV row
+ */
+static void print_stats_row()
+{
+	buddy_stats_t stats;
+
+	buddy_stats(&stats);
+
+	fprintf(csv, "%d,%zu,%zu,%zu,%zu,%zu,%.4f,%lu,%lu,%lu,%lu,%lu", linenum,
+	        stats.bytes_in_use, stats.bytes_free, stats.high_water,
+	        stats.bytes_requested, stats.bytes_granted, stats.internal_frag,
+	        stats.allocs, stats.frees, stats.splits, stats.merges, stats.failed);
+
+	for (int o = stats.min_order; o <= stats.max_order; ++o)
+		fprintf(csv, ",%.4f", stats.ext_frag[o]);
+
+	fprintf(csv, "\n");
+}
+
 /**
  * Simplify the command and call one of the sub parser functions
  *
@@ -221,14 +330,20 @@ static status_t parse_command(char* cmd, int cmd_len)
 
 	status_t status;
 
-	// We have 2 commands: alloc and free.
-	if (strstr(cmd, "alloc") != NULL)
+	// We have 3 commands: realloc, alloc and free.
+	if (strstr(cmd, "realloc") != NULL)
+		status = parse_realloc(cmd);
+	else if (strstr(cmd, "alloc") != NULL)
 		status = parse_alloc(cmd);
 	else if (strstr(cmd, "free") != NULL)
 		status = parse_free(cmd);
 	else
 		return parse_error(cmd);
 
+	// Failed allocations still show up in the statistics
+	if (csv != NULL && (status == SUCCESS || status == OUTOFMEMORY))
+		print_stats_row();
+
 	if (status != SUCCESS)
 		return status;
 
@@ -260,6 +375,133 @@ static status_t parse_file()
 }
 
 
+/**
+ * Measure how badly the free memory is split up
+ *
+ * @param stats Current allocator statistics
+ * @return 1 - (largest free block / free bytes), 0 when nothing is free
+ */
+static double external_frag(const buddy_stats_t* stats)
+{
+	int o;
+
+	if (stats->bytes_free == 0)
+		return 0.0;
+
+	// Above the largest free block no free memory is usable at all
+	for (o = stats->max_order; o > stats->min_order && stats->ext_frag[o] >= 1.0; --o)
+		;
+
+	return 1.0 - (double)(1UL << o) / stats->bytes_free;
+}
+
+/**
+ * Run every operation of a trace against the default arena
+ *
+ * @param ops Operations to run
+ * @param n_ops Number of operations
+ * @param blocks Handle table, all NULL on entry and on return
+ * @param peak_frag If not NULL, the peak external fragmentation is tracked
+ * here. This samples the statistics after every operation, so it should not
+ * be used for timed runs.
+ */
+static void run_trace(const trace_op_t* ops, size_t n_ops, void** blocks, double* peak_frag)
+{
+	buddy_stats_t stats;
+	size_t i;
+
+	for (i = 0; i < n_ops; ++i) {
+		const trace_op_t* op = &ops[i];
+
+		if (op->op == 'a') {
+			if (blocks[op->handle] != NULL)
+				buddy_free(blocks[op->handle]);
+
+			blocks[op->handle] = op->size <= INT_MAX ? buddy_alloc(op->size) : NULL;
+		}
+		else if (blocks[op->handle] != NULL) {
+			buddy_free(blocks[op->handle]);
+			blocks[op->handle] = NULL;
+		}
+
+		if (peak_frag != NULL) {
+			buddy_stats(&stats);
+
+			double frag = external_frag(&stats);
+			if (frag > *peak_frag)
+				*peak_frag = frag;
+		}
+	}
+}
+
+/**
+ * Replay a trace and report its performance
+ *
+ * The trace is run twice over a fresh arena of the given order: once timed,
+ * and once sampling the allocator statistics after every operation to find
+ * the peak fragmentation.
+ *
+ * @param arena_order Order of the arena to replay against
+ * @param map_flags Flags for buddy_map_region(), e.g. BUDDY_MAP_HUGEPAGE
+ * @return Program status.
+ */
+static status_t replay_trace(int arena_order, int map_flags)
+{
+	trace_op_t* ops;
+	size_t n_ops, n_handles, i;
+	trace_status_t loaded = trace_load(in, &ops, &n_ops, &n_handles);
+
+	if (loaded != TRACE_OK)
+		return loaded == TRACE_OUTOFMEMORY ? OUTOFMEMORY : BADINPUT;
+
+	size_t arena_size = 1UL << arena_order;
+	void* memory = buddy_map_region(arena_size, map_flags);
+	void** blocks = calloc(n_handles ? n_handles : 1, sizeof(void*));
+
+	if (memory == NULL || blocks == NULL || buddy_init_ex(memory, arena_size, 12) != 0) {
+		fprintf(stderr, "ERROR: Failed to set up a 2^%d byte arena\n", arena_order);
+		if (memory != NULL)
+			buddy_unmap_region(memory, arena_size);
+		free(ops);
+		free(blocks);
+		return OUTOFMEMORY;
+	}
+
+	struct timespec start, end;
+	buddy_stats_t stats;
+	double peak_frag = 0.0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	run_trace(ops, n_ops, blocks, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	buddy_stats(&stats);
+
+	// Release whatever the trace left allocated, then measure fragmentation
+	for (i = 0; i < n_handles; ++i)
+		blocks[i] = NULL;
+
+	buddy_init_ex(memory, arena_size, 12);
+	run_trace(ops, n_ops, blocks, &peak_frag);
+
+	double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+
+	printf("Operations:              %zu\n", n_ops);
+	printf("Allocations:             %lu (%lu failed)\n", stats.allocs + stats.failed, stats.failed);
+	printf("Frees:                   %lu\n", stats.frees);
+	printf("Time:                    %.3f ms\n", ns / 1e6);
+	printf("Time per operation:      %.1f ns\n", n_ops ? ns / n_ops : 0.0);
+	printf("Peak bytes in use:       %zu\n", stats.high_water);
+	printf("Internal fragmentation:  %.4f\n", stats.internal_frag);
+	printf("Peak external frag.:     %.4f\n", peak_frag);
+
+	buddy_unmap_region(memory, arena_size);
+	free(blocks);
+	free(ops);
+
+	return SUCCESS;
+}
+
 /**
  * Output program manual
  *
@@ -269,31 +511,71 @@ static status_t parse_file()
 void print_usage(char* prog_name, FILE* out)
 {
 	fprintf(out, "Usage:\n");
-	fprintf(out, "  ./%s [-i filename]\n", prog_name);
+	fprintf(out, "  ./%s [-i filename] [-c filename]\n", prog_name);
 	fprintf(out, "     -i [optional] - Specify an input file name to read from. If this option \n");
 	fprintf(out, "                     is not used then input is expected from standard input.\n");
+	fprintf(out, "     -c [optional] - Write allocator statistics as CSV to this file, one row\n");
+	fprintf(out, "                     per command.\n");
+	fprintf(out, "  ./%s -t [-a order] [-H] [-i filename]\n", prog_name);
+	fprintf(out, "     -t            - Replay a trace of numbered handles (see tracegen) and\n");
+	fprintf(out, "                     report time per operation and peak fragmentation.\n");
+	fprintf(out, "     -a [optional] - Order of the arena used for the replay (default: 30).\n");
+	fprintf(out, "     -H [optional] - Back the replay arena with transparent huge pages.\n");
 }
 
 int main(int argc, char** argv)
 {
 	int opt;
+	bool trace = false;
+	int arena_order = 30;
+	int map_flags = 0;
 
 	status_t prog_status;
 
 	in = stdin;
 
 	// Parse command line options
-	while ((opt = getopt(argc, argv, "i:")) != -1) {
+	while ((opt = getopt(argc, argv, "i:c:ta:H")) != -1) {
 		switch (opt) {
 		case 'i':
 			in = fopen(optarg, "r");
 			break;
 
+		case 'c':
+			csv = fopen(optarg, "w");
+
+			if (csv == NULL) {
+				perror("ERROR: Failed to open statistics file.");
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case 't':
+			trace = true;
+			break;
+
+		case 'H':
+			map_flags |= BUDDY_MAP_HUGEPAGE;
+			break;
+
+		case 'a':
+			arena_order = atoi(optarg);
+
+			if (arena_order < 12 || arena_order > 40) {
+				fprintf(stderr, "ERROR: Arena order must be between 12 and 40\n");
+				return EXIT_FAILURE;
+			}
+			break;
+
 		case '?':
 			switch (optopt) {
 			case 'i':
+			case 'c':
 				fprintf(stderr, "ERROR: Missing filename after '%c'", optopt);
 				return EXIT_FAILURE;
+			case 'a':
+				fprintf(stderr, "ERROR: Missing order after '%c'", optopt);
+				return EXIT_FAILURE;
 			}
 
 			print_usage(argv[0], stdout);
@@ -307,16 +589,32 @@ int main(int argc, char** argv)
 		return EXIT_FAILURE;
 	}
 
+	if (trace) {
+		prog_status = replay_trace(arena_order, map_flags);
+
+		if (in != stdin)
+			fclose(in);
+
+		return prog_status == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	// Zero memory
 	memset(var_map, 0, sizeof(var_map));
 
 	// Execute program
 	buddy_init();
+
+	if (csv != NULL)
+		print_stats_header();
+
 	prog_status = parse_file();
 
 	if (in != stdin)
 		fclose(in);
 
+	if (csv != NULL)
+		fclose(csv);
+
 	if (prog_status == SUCCESS)
 		return EXIT_SUCCESS;
 	else
@@ -0,0 +1,268 @@
+/**
+ * Slab Allocator
+ *
+ * Object caches in the style of the Linux kmem_cache, built on top of the
+ * buddy allocator. Each slab is one buddy block carved into fixed-size object
+ * slots. The slab header sits at the start of the block, so the slab of any
+ * object is found by rounding its address down to the block size.
+ */
+
+/**************************************************************************
+ * Included Files
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "buddy.h"
+#include "list.h"
+#include "slab.h"
+
+/**************************************************************************
+ * Public Definitions
+ **************************************************************************/
+/* a slab is grown until it holds at least this many objects */
+#define SLAB_MIN_OBJECTS 8
+
+/* round x up to a multiple of the power of two a */
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/**************************************************************************
+ * Public Types
+ **************************************************************************/
+
+/**
+ * Header at the start of every slab
+ */
+typedef struct {
+	// Link on one of the cache's slab lists
+	struct list_head list;
+
+	// Singly linked list threaded through the free objects
+	void *free;
+
+	// Number of objects handed out from this slab
+	unsigned int inuse;
+} slab_t;
+
+/**
+ * A cache of equally sized objects
+ */
+struct slab_cache {
+	/* arena the slabs are allocated from */
+	buddy_arena_t *arena;
+
+	/* size of one object slot, a multiple of align */
+	size_t size;
+
+	/* alignment of every object, at least that of a pointer */
+	size_t align;
+
+	/* order of the buddy block backing each slab */
+	int slab_order;
+
+	/* objects per slab */
+	unsigned int capacity;
+
+	/* slabs with some, none and all of their objects free */
+	struct list_head partial;
+	struct list_head full;
+	struct list_head empty;
+};
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+/**
+ * Get a new slab from the buddy allocator and thread its free list
+ *
+ * @param cache cache the slab belongs to
+ * @return the new slab
+ * @return NULL if the arena is out of memory
+ */
+static slab_t *slab_grow(slab_cache_t *cache)
+{
+	slab_t *slab = buddy_arena_alloc(cache->arena, 1UL << cache->slab_order);
+	char *obj;
+	unsigned int i;
+
+	if(slab == NULL)
+		return NULL;
+
+	slab->inuse = 0;
+	slab->free = NULL;
+
+	// The arena base need not be aligned, so align the first object by its
+	// address rather than by its offset into the slab
+	obj = (char *)ALIGN_UP((uintptr_t)slab + sizeof(slab_t), cache->align);
+
+	// Thread the free list back to front so objects are handed out in order
+	obj += (size_t)(cache->capacity - 1) * cache->size;
+	for(i = 0; i < cache->capacity; i++, obj -= cache->size) {
+		*(void **)obj = slab->free;
+		slab->free = obj;
+	}
+
+	list_add(&slab->list, &cache->empty);
+	return slab;
+}
+
+/**
+ * Create an object cache backed by a given buddy arena
+ *
+ * @param arena arena to take slabs from
+ * @param size size of each object in bytes
+ * @param align alignment of each object, a power of two; anything below the
+ *        alignment of a pointer (including 0) is raised to it
+ * @return the new cache
+ * @return NULL if the arguments are invalid or out of memory
+ */
+slab_cache_t *slab_create_arena(buddy_arena_t *arena, size_t size, size_t align)
+{
+	slab_cache_t *cache;
+	size_t page_size = buddy_arena_page_size(arena);
+	size_t slab_size, offset;
+
+	if(size == 0 || (align & (align - 1)) != 0 || align > page_size)
+		return NULL;
+
+	// Free objects hold the free list link, which must be pointer aligned
+	if(align < __alignof__(void *))
+		align = __alignof__(void *);
+
+	cache = malloc(sizeof(slab_cache_t));
+	if(cache == NULL)
+		return NULL;
+
+	// Every slot must be able to hold the free list link
+	if(size < sizeof(void *))
+		size = sizeof(void *);
+
+	cache->arena = arena;
+	cache->size = ALIGN_UP(size, align);
+	cache->align = align;
+
+	// Furthest the first object can sit from the start of a slab
+	offset = sizeof(slab_t) + align - 1;
+
+	// Smallest block that holds the header and enough objects to be worth it
+	cache->slab_order = __builtin_ctzl(page_size);
+	for(slab_size = page_size;
+		slab_size < offset + cache->size * SLAB_MIN_OBJECTS && slab_size < (1UL << 30);
+		slab_size <<= 1)
+		cache->slab_order++;
+
+	cache->capacity = slab_size > offset ? (slab_size - offset) / cache->size : 0;
+
+	if(cache->capacity == 0) {
+		free(cache);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&cache->partial);
+	INIT_LIST_HEAD(&cache->full);
+	INIT_LIST_HEAD(&cache->empty);
+
+	return cache;
+}
+
+/**
+ * Create an object cache backed by the default buddy arena
+ *
+ * @param size size of each object in bytes
+ * @param align alignment of each object, a power of two; anything below the
+ *        alignment of a pointer (including 0) is raised to it
+ * @return the new cache
+ * @return NULL if the arguments are invalid or out of memory
+ */
+slab_cache_t *slab_create(size_t size, size_t align)
+{
+	return slab_create_arena(buddy_default_arena(), size, align);
+}
+
+/**
+ * Allocate one object from a cache
+ *
+ * Partially used slabs are preferred so that empty slabs can go back to the
+ * buddy allocator.
+ *
+ * @param cache cache to allocate from
+ * @return the object
+ * @return NULL if the arena is out of memory
+ */
+void *slab_alloc(slab_cache_t *cache)
+{
+	slab_t *slab;
+	void *obj;
+
+	if(!list_empty(&cache->partial))
+		slab = list_entry(cache->partial.next, slab_t, list);
+	else if(!list_empty(&cache->empty) || slab_grow(cache) != NULL)
+		slab = list_entry(cache->empty.next, slab_t, list);
+	else
+		return NULL;
+
+	obj = slab->free;
+	slab->free = *(void **)obj;
+	slab->inuse++;
+
+	if(slab->inuse == cache->capacity)
+		list_move(&slab->list, &cache->full);
+	else if(slab->inuse == 1)
+		list_move(&slab->list, &cache->partial);
+
+	return obj;
+}
+
+/**
+ * Return an object to its cache
+ *
+ * One empty slab is kept around to absorb alloc/free churn; any further
+ * empty slab is handed back to the buddy allocator.
+ *
+ * @param cache cache the object was allocated from
+ * @param obj object to free
+ */
+void slab_free(slab_cache_t *cache, void *obj)
+{
+	slab_t *slab = buddy_arena_block_start(cache->arena, obj, cache->slab_order);
+
+	*(void **)obj = slab->free;
+	slab->free = obj;
+	slab->inuse--;
+
+	if(slab->inuse == 0) {
+		if(list_empty(&cache->empty)) {
+			list_move(&slab->list, &cache->empty);
+		}
+		else {
+			list_del(&slab->list);
+			buddy_arena_free(cache->arena, slab);
+		}
+	}
+	else if(slab->inuse == cache->capacity - 1) {
+		list_move(&slab->list, &cache->partial);
+	}
+}
+
+/**
+ * Release a cache and all of its slabs
+ *
+ * Every object allocated from the cache becomes invalid.
+ *
+ * @param cache cache to destroy
+ */
+void slab_destroy(slab_cache_t *cache)
+{
+	struct list_head *lists[] = { &cache->partial, &cache->full, &cache->empty };
+	struct list_head *pos, *n;
+	unsigned int i;
+
+	for(i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+		list_for_each_safe(pos, n, lists[i]) {
+			buddy_arena_free(cache->arena, list_entry(pos, slab_t, list));
+		}
+	}
+
+	free(cache);
+}
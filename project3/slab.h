@@ -0,0 +1,17 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#include "buddy.h"
+
+/* Opaque handle to a cache of fixed-size objects */
+typedef struct slab_cache slab_cache_t;
+
+slab_cache_t *slab_create(size_t size, size_t align);
+slab_cache_t *slab_create_arena(buddy_arena_t *arena, size_t size, size_t align);
+void *slab_alloc(slab_cache_t *cache);
+void slab_free(slab_cache_t *cache, void *obj);
+void slab_destroy(slab_cache_t *cache);
+
+#endif // SLAB_H
@@ -0,0 +1,241 @@
+/**
+ * Multi-threaded stress benchmark for the buddy allocator
+ *
+ * Every thread runs a private mix of allocations and frees against one
+ * shared arena. The run is repeated for 1, 2, 4, ... threads, once with only
+ * the arena lock and once with per-CPU page caches, and the throughput of
+ * each run is printed.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buddy.h"
+
+/**
+ * Number of blocks each thread keeps live at once
+ */
+#define LIVE_BLOCKS 256
+
+/**
+ * Arguments and results of one worker thread
+ */
+typedef struct worker_t {
+	buddy_arena_t *arena;      ///< Shared arena
+	pthread_barrier_t *start;  ///< Released once every worker is ready
+	unsigned long seed;        ///< Seed of the private random stream
+	long ops;                  ///< Number of operations to run
+	long failed;               ///< Allocations that returned NULL
+} worker_t;
+
+static int page_order = 12;     // Order of the arena's smallest block
+static int arena_order = 28;    // Order of the whole arena
+static long ops_per_thread = 1000000;
+
+/**
+ * xorshift64 random number generator
+ *
+ * @param state Generator state, updated in place
+ * @return Next pseudo-random number
+ */
+static inline unsigned long next_rand(unsigned long *state)
+{
+	unsigned long x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/**
+ * Worker thread: alternately fill and empty random slots of a private table
+ *
+ * Nine out of ten allocations fit in a single page, the rest are spread
+ * over 2 to 16 pages.
+ *
+ * @param arg Pointer to this thread's worker_t
+ * @return NULL
+ */
+static void *worker(void *arg)
+{
+	worker_t *w = arg;
+	void *live[LIVE_BLOCKS];
+	unsigned long rng = w->seed;
+	long i;
+
+	memset(live, 0, sizeof(live));
+	pthread_barrier_wait(w->start);
+
+	for (i = 0; i < w->ops; i++) {
+		unsigned long r = next_rand(&rng);
+		int slot = r % LIVE_BLOCKS;
+
+		if (live[slot] != NULL) {
+			buddy_arena_free(w->arena, live[slot]);
+			live[slot] = NULL;
+			continue;
+		}
+
+		size_t size = (r >> 16) % 10 != 0
+			? 1 + (r >> 24) % (1UL << page_order)
+			: (1UL << page_order) * (2 + (r >> 24) % 15);
+
+		live[slot] = buddy_arena_alloc(w->arena, size);
+
+		if (live[slot] == NULL)
+			w->failed++;
+		else
+			*(char *)live[slot] = 1;
+	}
+
+	for (i = 0; i < LIVE_BLOCKS; i++)
+		if (live[i] != NULL)
+			buddy_arena_free(w->arena, live[i]);
+
+	return NULL;
+}
+
+/**
+ * Run one measurement
+ *
+ * @param memory Backing store of the arena
+ * @param threads Number of worker threads
+ * @param n_caches Number of per-CPU caches, 0 for the arena lock only
+ * @return Operations per second over all threads, or a negative value on error
+ */
+static double run(void *memory, int threads, int n_caches)
+{
+	buddy_arena_t *arena = buddy_arena_create(memory, 1UL << arena_order, page_order);
+	pthread_t *tids = malloc(threads * sizeof(pthread_t));
+	worker_t *workers = malloc(threads * sizeof(worker_t));
+	pthread_barrier_t start;
+	struct timespec t0, t1;
+	long failed = 0;
+	int i;
+
+	if (arena == NULL || tids == NULL || workers == NULL
+	    || buddy_arena_set_concurrent(arena, n_caches) != 0) {
+		buddy_arena_destroy(arena);
+		free(tids);
+		free(workers);
+		return -1;
+	}
+
+	pthread_barrier_init(&start, NULL, threads + 1);
+
+	for (i = 0; i < threads; i++) {
+		workers[i].arena = arena;
+		workers[i].start = &start;
+		workers[i].seed = 0x9e3779b97f4a7c15UL * (i + 1);
+		workers[i].ops = ops_per_thread;
+		workers[i].failed = 0;
+		pthread_create(&tids[i], NULL, worker, &workers[i]);
+	}
+
+	pthread_barrier_wait(&start);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(tids[i], NULL);
+		failed += workers[i].failed;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (failed > 0)
+		fprintf(stderr, "WARNING: %ld allocations failed with %d thread(s)\n", failed, threads);
+
+	pthread_barrier_destroy(&start);
+	buddy_arena_destroy(arena);
+	free(tids);
+	free(workers);
+
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	return (double)threads * ops_per_thread / secs;
+}
+
+/**
+ * Output program manual
+ *
+ * @param prog_name Name of the program passed in as a command line argument.
+ * @param out File stream to write to.
+ */
+void print_usage(char* prog_name, FILE* out)
+{
+	fprintf(out, "Usage:\n");
+	fprintf(out, "  ./%s [-t threads] [-n ops] [-a order] [-p order]\n", prog_name);
+	fprintf(out, "     -t - Largest thread count to measure (default: online CPUs)\n");
+	fprintf(out, "     -n - Operations per thread (default: %ld)\n", ops_per_thread);
+	fprintf(out, "     -a - Order of the arena size (default: %d)\n", arena_order);
+	fprintf(out, "     -p - Order of the page size (default: %d)\n", page_order);
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int n_cpus = max_threads;
+
+	while ((opt = getopt(argc, argv, "t:n:a:p:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'n':
+			ops_per_thread = atol(optarg);
+			break;
+		case 'a':
+			arena_order = atoi(optarg);
+			break;
+		case 'p':
+			page_order = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0], stdout);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (max_threads <= 0 || ops_per_thread <= 0 || n_cpus <= 0) {
+		print_usage(argv[0], stdout);
+		return EXIT_FAILURE;
+	}
+
+	void *memory = mmap(NULL, 1UL << arena_order, PROT_READ | PROT_WRITE,
+	                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (memory == MAP_FAILED) {
+		perror("ERROR: Failed to map arena");
+		return EXIT_FAILURE;
+	}
+
+	printf("%8s %16s %16s\n", "threads", "locked ops/s", "pcp ops/s");
+
+	for (int threads = 1; threads <= max_threads; ) {
+		double locked = run(memory, threads, 0);
+		double cached = run(memory, threads, n_cpus);
+
+		if (locked < 0 || cached < 0) {
+			fprintf(stderr, "ERROR: Failed to set up arena\n");
+			return EXIT_FAILURE;
+		}
+
+		printf("%8d %16.0f %16.0f\n", threads, locked, cached);
+
+		// Double each round, but always finish with the largest count asked for
+		if (threads < max_threads && threads * 2 > max_threads)
+			threads = max_threads;
+		else
+			threads *= 2;
+	}
+
+	munmap(memory, 1UL << arena_order);
+	return EXIT_SUCCESS;
+}
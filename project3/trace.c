@@ -0,0 +1,95 @@
+/**
+ * Allocation Traces
+ *
+ * Reader for the trace format replayed by `./buddy -t` and `allocbench`, and
+ * written by `tracegen`.
+ */
+
+/**************************************************************************
+ * Included Files
+ **************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+/**************************************************************************
+ * Public Functions
+ **************************************************************************/
+/**
+ * Read a trace into memory
+ *
+ * A trace has one operation per line: "a <handle> <size>" allocates size
+ * bytes and stores the block in the numbered handle, "f <handle>" frees the
+ * block stored in the handle. Blank lines and lines starting with '#' are
+ * ignored. Errors are reported on stderr.
+ *
+ * @param in Stream to read from
+ * @param ops Receives a heap-allocated array of operations
+ * @param n_ops Receives the number of operations
+ * @param n_handles Receives one more than the largest handle used
+ * @return TRACE_OK, TRACE_BADINPUT on a malformed line or TRACE_OUTOFMEMORY
+ */
+trace_status_t trace_load(FILE* in, trace_op_t** ops, size_t* n_ops, size_t* n_handles)
+{
+	char* line = NULL;
+	size_t len = 0;
+	size_t cap = 1024;
+	trace_op_t* buf = malloc(cap * sizeof(trace_op_t));
+	trace_status_t status = buf != NULL ? TRACE_OK : TRACE_OUTOFMEMORY;
+	int linenum = 0;
+
+	*n_ops = 0;
+	*n_handles = 0;
+
+	while (status == TRACE_OK && getline(&line, &len, in) > 0) {
+		char* cursor = line + 1;
+		trace_op_t op;
+
+		++linenum;
+
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\0')
+			continue;
+
+		op.op = line[0];
+		op.handle = strtoul(cursor, &cursor, 10);
+		op.size = op.op == 'a' ? strtoul(cursor, &cursor, 10) : 0;
+
+		if ((op.op != 'a' && op.op != 'f') || (op.op == 'a' && op.size == 0)) {
+			fprintf(stderr, "ERROR: Line %d: Failed to parse trace operation\n", linenum);
+			fprintf(stderr, "    Faulting Command: %s", line);
+			status = TRACE_BADINPUT;
+			break;
+		}
+
+		if (*n_ops == cap) {
+			trace_op_t* grown = realloc(buf, 2 * cap * sizeof(trace_op_t));
+
+			if (grown == NULL) {
+				status = TRACE_OUTOFMEMORY;
+				break;
+			}
+
+			buf = grown;
+			cap *= 2;
+		}
+
+		if (op.handle >= *n_handles)
+			*n_handles = op.handle + 1;
+
+		buf[(*n_ops)++] = op;
+	}
+
+	free(line);
+
+	if (status == TRACE_OUTOFMEMORY)
+		fprintf(stderr, "ERROR: Out of memory while loading trace\n");
+
+	if (status != TRACE_OK) {
+		free(buf);
+		return status;
+	}
+
+	*ops = buf;
+	return TRACE_OK;
+}
@@ -0,0 +1,23 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* One operation of an allocation trace */
+typedef struct trace_op_t {
+	char op;          ///< 'a' to allocate, 'f' to free
+	size_t handle;    ///< Slot the block is stored in
+	size_t size;      ///< Bytes to allocate, unused for frees
+} trace_op_t;
+
+/* Outcome of trace_load() */
+typedef enum trace_status_t {
+	TRACE_OK = 0,
+	TRACE_BADINPUT,
+	TRACE_OUTOFMEMORY
+} trace_status_t;
+
+trace_status_t trace_load(FILE* in, trace_op_t** ops, size_t* n_ops, size_t* n_handles);
+
+#endif // TRACE_H
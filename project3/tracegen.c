@@ -0,0 +1,219 @@
+/**
+ * Synthetic workload generator for the buddy simulator's trace mode
+ *
+ * Writes a trace of numbered-handle allocations and frees to standard
+ * output. Sizes are drawn uniformly or from a power law, and blocks are
+ * released in LIFO, FIFO or random order. Replay the result with
+ * `./buddy -t -i <trace>`.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/**
+ * Distribution of allocation sizes
+ */
+typedef enum dist_t {
+	UNIFORM,
+	POWERLAW
+} dist_t;
+
+/**
+ * Order in which live blocks are freed
+ */
+typedef enum lifetime_t {
+	LIFO,
+	FIFO,
+	RANDOM
+} lifetime_t;
+
+static const char* dist_names[] = { "uniform", "powerlaw" };
+static const char* lifetime_names[] = { "lifo", "fifo", "random" };
+
+static unsigned long rng_state = 1;
+
+/**
+ * xorshift64 random number generator
+ *
+ * @return Next pseudo-random number
+ */
+static unsigned long next_rand()
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+/**
+ * Uniform random number in [0, 1)
+ */
+static double next_unit()
+{
+	return (next_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Draw an allocation size
+ *
+ * The power law has density proportional to size^-alpha between min and
+ * max, sampled by inverting its CDF, so small sizes dominate with a long
+ * tail of large ones.
+ *
+ * @param dist Size distribution
+ * @param min Smallest size
+ * @param max Largest size
+ * @param alpha Exponent of the power law, must not be 1
+ * @return Size in bytes
+ */
+static unsigned long next_size(dist_t dist, unsigned long min, unsigned long max, double alpha)
+{
+	if (dist == UNIFORM)
+		return min + next_rand() % (max - min + 1);
+
+	double a = pow(min, 1.0 - alpha);
+	double b = pow(max, 1.0 - alpha);
+	double size = pow(a + (b - a) * next_unit(), 1.0 / (1.0 - alpha));
+
+	return size < min ? min : size > max ? max : (unsigned long)size;
+}
+
+/**
+ * Output program manual
+ *
+ * @param prog_name Name of the program passed in as a command line argument.
+ * @param out File stream to write to.
+ */
+void print_usage(char* prog_name, FILE* out)
+{
+	fprintf(out, "Usage:\n");
+	fprintf(out, "  ./%s [-n ops] [-l live] [-d uniform|powerlaw] [-o lifo|fifo|random]\n", prog_name);
+	fprintf(out, "       [-m min] [-M max] [-p alpha] [-s seed]\n");
+	fprintf(out, "     -n - Number of operations (default: 1000000)\n");
+	fprintf(out, "     -l - Largest number of blocks alive at once (default: 10000)\n");
+	fprintf(out, "     -d - Size distribution (default: uniform)\n");
+	fprintf(out, "     -o - Order in which blocks are freed (default: random)\n");
+	fprintf(out, "     -m - Smallest allocation in bytes (default: 16)\n");
+	fprintf(out, "     -M - Largest allocation in bytes (default: 65536)\n");
+	fprintf(out, "     -p - Power law exponent (default: 2.0)\n");
+	fprintf(out, "     -s - Random seed (default: 1)\n");
+}
+
+/**
+ * Find a name in a table
+ *
+ * @return Index of the name, or -1 if it is not in the table
+ */
+static int lookup(const char* name, const char** table, int n)
+{
+	for (int i = 0; i < n; ++i)
+		if (strcasecmp(name, table[i]) == 0)
+			return i;
+
+	return -1;
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+	long n_ops = 1000000, max_live = 10000;
+	unsigned long min = 16, max = 65536;
+	double alpha = 2.0;
+	int dist = UNIFORM, lifetime = RANDOM;
+
+	while ((opt = getopt(argc, argv, "n:l:d:o:m:M:p:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n_ops = atol(optarg);
+			break;
+		case 'l':
+			max_live = atol(optarg);
+			break;
+		case 'd':
+			dist = lookup(optarg, dist_names, 2);
+			break;
+		case 'o':
+			lifetime = lookup(optarg, lifetime_names, 3);
+			break;
+		case 'm':
+			min = strtoul(optarg, NULL, 10);
+			break;
+		case 'M':
+			max = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			alpha = atof(optarg);
+			break;
+		case 's':
+			rng_state = strtoul(optarg, NULL, 10) * 0x9e3779b97f4a7c15UL | 1;
+			break;
+		default:
+			print_usage(argv[0], stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (n_ops < 0 || max_live <= 0 || dist < 0 || lifetime < 0
+	    || min == 0 || max < min || alpha == 1.0) {
+		print_usage(argv[0], stderr);
+		return EXIT_FAILURE;
+	}
+
+	// Live handles kept in a ring: LIFO pops the back, FIFO the front and
+	// RANDOM swaps a random entry to the back first
+	long* live = malloc(max_live * sizeof(long));
+	long* spare = malloc(max_live * sizeof(long));
+	long head = 0, n_live = 0, n_spare = 0, next_handle = 0;
+
+	if (live == NULL || spare == NULL) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("# buddy trace: %ld ops, %ld live, %s sizes %lu-%lu, %s frees\n",
+	       n_ops, max_live, dist_names[dist], min, max, lifetime_names[lifetime]);
+
+	for (long i = 0; i < n_ops; ++i) {
+		// Drain everything over the last max_live operations
+		int drain = n_ops - i <= n_live;
+		int do_alloc = !drain && (n_live == 0 || (n_live < max_live && next_rand() % 2 == 0));
+
+		if (do_alloc) {
+			long handle = n_spare > 0 ? spare[--n_spare] : next_handle++;
+
+			live[(head + n_live++) % max_live] = handle;
+			printf("a %ld %lu\n", handle, next_size(dist, min, max, alpha));
+			continue;
+		}
+
+		long slot;
+
+		if (lifetime == FIFO) {
+			slot = head;
+			head = (head + 1) % max_live;
+		}
+		else {
+			slot = (head + n_live - 1) % max_live;
+
+			if (lifetime == RANDOM) {
+				long other = (head + next_rand() % n_live) % max_live;
+				long tmp = live[other];
+
+				live[other] = live[slot];
+				live[slot] = tmp;
+			}
+		}
+
+		n_live--;
+		spare[n_spare++] = live[slot];
+		printf("f %ld\n", live[slot]);
+	}
+
+	free(live);
+	free(spare);
+	return EXIT_SUCCESS;
+}